@@ -0,0 +1,220 @@
+/* LoRa driver SPI microbenchmark
+ *
+ * Times the register and FIFO paths of the driver on target and prints one
+ * table per SPI clock, so a driver change that slows down the hot path
+ * shows up as a diff between two runs. The radio task is never started:
+ * the benchmark owns the bus and the module stays in standby.
+ *
+ * Every call is timed on its own with esp_timer_get_time(); the first row
+ * ("timer") is an empty call and gives the overhead included in the others.
+ * Clocks above what the module or the wiring can take are detected by a
+ * FIFO read-back and skipped.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/spi_master.h"
+
+#include "lora.h"
+
+#define REG_FIFO 0x00
+#define REG_FIFO_ADDR_PTR 0x0d
+#define REG_PAYLOAD_LENGTH 0x22
+#define REG_VERSION 0x42
+
+#define BENCH_REG_CALLS 1000
+#define BENCH_BURST_CALLS 200
+#define BENCH_FIFO_SIZE 255
+#define BENCH_COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+#if CONFIG_REG_ACCESS_POLLING
+#define BENCH_REG_ACCESS "polling"
+#else
+#define BENCH_REG_ACCESS "interrupt"
+#endif
+#if CONFIG_BUFFER_IO
+#define BENCH_BUFFER_IO "on"
+#else
+#define BENCH_BUFFER_IO "off"
+#endif
+#if CONFIG_LORA_SPI_QUEUED
+#define BENCH_SPI_QUEUED "on"
+#else
+#define BENCH_SPI_QUEUED "off"
+#endif
+#if CONFIG_LORA_SPI_STATS
+#define BENCH_SPI_STATS "on"
+#else
+#define BENCH_SPI_STATS "off"
+#endif
+
+static const char *TAG = "LoRa_Bench";
+
+// The SX127x is rated for 10 MHz; lora_init() uses CONFIG_LORA_SPI_CLOCK_KHZ
+static const int clocks_hz[] = { 9000000, 10000000, 13333333, 16000000, 20000000 };
+static const int burst_lens[] = { 16, 64, 255 };
+
+static const lora_pins_t pins = { CONFIG_CS_GPIO, CONFIG_RST_GPIO, CONFIG_DIO0_GPIO };
+static lora_dev_t *dev;
+static uint8_t fifo_buf[BENCH_FIFO_SIZE];
+
+typedef void (*bench_fn_t)(int len);
+
+static void run_timer(int len) {
+}
+
+static void run_read_reg(int len) {
+    lora_read_reg(dev, REG_VERSION);
+}
+
+static void run_write_reg(int len) {
+    lora_write_reg(dev, REG_FIFO_ADDR_PTR, 0);
+}
+
+// Raw single register read, bypassing the driver's choice of transfer
+static void run_spi(int polling) {
+    spi_transaction_t t = {
+        .flags = SPI_TRANS_USE_RXDATA,
+        .cmd = REG_VERSION,
+        .length = 8,
+    };
+    if (polling) spi_device_polling_transmit(lora_spi_device(dev), &t);
+    else spi_device_transmit(lora_spi_device(dev), &t);
+}
+
+static void run_spi_polling(int len) {
+    run_spi(1);
+}
+
+static void run_spi_interrupt(int len) {
+    run_spi(0);
+}
+
+// The FIFO pointer wraps around within the 256 byte FIFO, so bursts need
+// no pointer reset in between
+static void run_fifo_write(int len) {
+    lora_write_reg_buffer(dev, REG_FIFO, fifo_buf, len);
+}
+
+static void run_fifo_read(int len) {
+    lora_read_reg_buffer(dev, REG_FIFO, fifo_buf, len);
+}
+
+// The CONFIG_BUFFER_IO=n path: one transaction per byte
+static void run_fifo_write_bytes(int len) {
+    for (int i = 0; i < len; i++) {
+        lora_write_reg(dev, REG_FIFO, fifo_buf[i]);
+    }
+}
+
+static void run_fifo_read_bytes(int len) {
+    for (int i = 0; i < len; i++) {
+        fifo_buf[i] = lora_read_reg(dev, REG_FIFO);
+    }
+}
+
+// Packet setup of lora_send_packet(), without the TX mode switch
+static void run_tx_setup(int len) {
+    lora_write_reg(dev, REG_FIFO_ADDR_PTR, 0);
+    lora_write_reg_buffer(dev, REG_FIFO, fifo_buf, len);
+    lora_write_reg(dev, REG_PAYLOAD_LENGTH, len);
+}
+
+static void run_tx_setup_batch(int len) {
+    lora_batch_begin(dev);
+    run_tx_setup(len);
+    lora_batch_end(dev);
+}
+
+static void bench(const char *name, bench_fn_t fn, int len, int calls) {
+    int64_t total_us = 0, min_us = INT64_MAX, max_us = 0;
+
+    fn(len); // Warm up caches and the driver
+    for (int i = 0; i < calls; i++) {
+        int64_t start = esp_timer_get_time();
+        fn(len);
+        int64_t us = esp_timer_get_time() - start;
+        total_us += us;
+        if (us < min_us) min_us = us;
+        if (us > max_us) max_us = us;
+    }
+
+    double avg_us = (double)total_us / calls;
+    int bytes = len > 0 ? len : 1;
+    printf("%-20s %5d %6d %8.2f %7lld %7lld %8.1f\n", name, len, calls, avg_us, (long long)min_us, (long long)max_us,
+           avg_us > 0 ? bytes * 1000.0 / avg_us : 0.0);
+    vTaskDelay(1); // Let the idle task run between tests
+}
+
+// Write a pattern to the FIFO and read it back
+static int fifo_check(uint8_t seed) {
+    uint8_t out[BENCH_FIFO_SIZE], in[BENCH_FIFO_SIZE];
+
+    if (lora_read_reg(dev, REG_VERSION) != 0x12) return 0;
+    for (int i = 0; i < BENCH_FIFO_SIZE; i++) {
+        out[i] = (uint8_t)(i * 7 + seed);
+    }
+    lora_write_reg(dev, REG_FIFO_ADDR_PTR, 0);
+    lora_write_reg_buffer(dev, REG_FIFO, out, sizeof(out));
+    lora_write_reg(dev, REG_FIFO_ADDR_PTR, 0);
+    lora_read_reg_buffer(dev, REG_FIFO, in, sizeof(in));
+    return memcmp(out, in, sizeof(out)) == 0;
+}
+
+static void bench_clock(int hz) {
+    int actual_hz = lora_set_spi_clock(dev, hz);
+    if (actual_hz == 0) {
+        ESP_LOGE(TAG, "SPI device lost at %d Hz.", hz);
+        return;
+    }
+
+    printf("\nSPI clock %d kHz (requested %d kHz)\n", actual_hz / 1000, hz / 1000);
+    if (!fifo_check((uint8_t)(actual_hz >> 10))) {
+        printf("FIFO read-back failed, skipped\n");
+        return;
+    }
+
+    printf("%-20s %5s %6s %8s %7s %7s %8s\n", "test", "bytes", "calls", "avg us", "min us", "max us", "kB/s");
+    bench("timer", run_timer, 0, BENCH_REG_CALLS);
+    bench("read_reg", run_read_reg, 1, BENCH_REG_CALLS);
+    bench("write_reg", run_write_reg, 1, BENCH_REG_CALLS);
+    bench("spi_polling", run_spi_polling, 1, BENCH_REG_CALLS);
+    bench("spi_interrupt", run_spi_interrupt, 1, BENCH_REG_CALLS);
+    for (int i = 0; i < BENCH_COUNT(burst_lens); i++) {
+        bench("fifo_write", run_fifo_write, burst_lens[i], BENCH_BURST_CALLS);
+        bench("fifo_read", run_fifo_read, burst_lens[i], BENCH_BURST_CALLS);
+    }
+    for (int i = 0; i < BENCH_COUNT(burst_lens); i++) {
+        bench("fifo_write_bytes", run_fifo_write_bytes, burst_lens[i], BENCH_BURST_CALLS);
+        bench("fifo_read_bytes", run_fifo_read_bytes, burst_lens[i], BENCH_BURST_CALLS);
+    }
+    for (int i = 0; i < BENCH_COUNT(burst_lens); i++) {
+        bench("tx_setup", run_tx_setup, burst_lens[i], BENCH_BURST_CALLS);
+        bench("tx_setup_batch", run_tx_setup_batch, burst_lens[i], BENCH_BURST_CALLS);
+    }
+}
+
+void app_main() {
+    dev = lora_init(&pins);
+    if (dev == NULL) {
+        ESP_LOGE(TAG, "LoRa module not recognized.");
+        return;
+    }
+    lora_idle(dev); // The FIFO is not accessible in sleep mode
+
+    printf("\nLoRa SPI benchmark: register access " BENCH_REG_ACCESS ", buffer IO " BENCH_BUFFER_IO
+           ", queued " BENCH_SPI_QUEUED ", SPI stats " BENCH_SPI_STATS "\n");
+    for (int i = 0; i < BENCH_COUNT(clocks_hz); i++) {
+        bench_clock(clocks_hz[i]);
+    }
+
+    lora_set_spi_clock(dev, CONFIG_LORA_SPI_CLOCK_KHZ * 1000);
+    lora_sleep(dev);
+    printf("\nDone.\n");
+}
@@ -0,0 +1,246 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "mqtt_client.h"
+
+#include "backhaul.h"
+#include "spill.h"
+
+/*
+ * Backhaul task.
+ * Takes the readings out of the telemetry ring, packs them into one
+ * MQTT publish per gateway cycle, or right away for an alert
+ * (telemetry_push_alert()), and spills batches to flash while the link is
+ * down. It runs at a lower priority than the radio and gateway
+ * tasks and only shares the lock-free telemetry ring with them, so a
+ * stalled network never delays the LoRa cycle.
+ */
+
+#define BACKHAUL_TASK_PRIORITY         4
+#define BACKHAUL_TASK_STACK            (1024 * 4)
+
+// Publish what is buffered even if no cycle end was signalled, unless a
+// cycle is running (telemetry_alerts_held()) and its end will
+#define BACKHAUL_FLUSH_TIMEOUT_MS      30000
+
+#define BACKHAUL_BACKOFF_MIN_MS        1000
+#define BACKHAUL_BACKOFF_MAX_MS        60000
+#define BACKHAUL_QOS                   1
+
+#ifndef CONFIG_BACKHAUL_TASK_CORE
+#define CONFIG_BACKHAUL_TASK_CORE      0
+#elif defined(CONFIG_RADIO_TASK_CORE) && CONFIG_BACKHAUL_TASK_CORE == CONFIG_RADIO_TASK_CORE
+#error "CONFIG_BACKHAUL_TASK_CORE must differ from CONFIG_RADIO_TASK_CORE"
+#endif
+
+#define BACKHAUL_BATCH_SIZE            (sizeof(backhaul_batch_t) + CONFIG_BACKHAUL_BATCH_MAX * sizeof(telemetry_record_t))
+
+_Static_assert(BACKHAUL_BATCH_SIZE <= SPILL_MAX_PAYLOAD, "CONFIG_BACKHAUL_BATCH_MAX too large for a spill slot");
+
+#define TAG "BACKHAUL"
+
+static TaskHandle_t _task = NULL;
+static esp_mqtt_client_handle_t _mqtt = NULL;
+static int _mqtt_started = 0;
+static int _wifi_up = 0;
+static int _mqtt_up = 0;
+static esp_timer_handle_t _wifi_timer = NULL;
+static esp_timer_handle_t _mqtt_timer = NULL;
+static int _wifi_backoff_ms = BACKHAUL_BACKOFF_MIN_MS;
+static int _mqtt_backoff_ms = BACKHAUL_BACKOFF_MIN_MS;
+static uint32_t _seq = 0;
+static uint8_t _batch[BACKHAUL_BATCH_SIZE];
+
+/**
+ * Arm a reconnect timer and double its backoff for the next failure.
+ */
+static void
+backhaul_retry(esp_timer_handle_t timer, int *backoff_ms)
+{
+   esp_timer_stop(timer);
+   esp_timer_start_once(timer, (uint64_t)*backoff_ms * 1000);
+   ESP_LOGI(TAG, "Reconnecting in %d ms", *backoff_ms);
+   *backoff_ms *= 2;
+   if (*backoff_ms > BACKHAUL_BACKOFF_MAX_MS) *backoff_ms = BACKHAUL_BACKOFF_MAX_MS;
+}
+
+static void
+backhaul_wifi_retry(void *arg)
+{
+   esp_wifi_connect();
+}
+
+static void
+backhaul_mqtt_retry(void *arg)
+{
+   esp_mqtt_client_reconnect(_mqtt);
+}
+
+static void
+backhaul_wifi_event(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+   if (base == WIFI_EVENT && id == WIFI_EVENT_STA_START) {
+      esp_wifi_connect();
+   } else if (base == WIFI_EVENT && id == WIFI_EVENT_STA_DISCONNECTED) {
+      __atomic_store_n(&_wifi_up, 0, __ATOMIC_RELEASE);
+      backhaul_retry(_wifi_timer, &_wifi_backoff_ms);
+   } else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
+      __atomic_store_n(&_wifi_up, 1, __ATOMIC_RELEASE);
+      _wifi_backoff_ms = BACKHAUL_BACKOFF_MIN_MS;
+      if (!_mqtt_started) {
+         _mqtt_started = esp_mqtt_client_start(_mqtt) == ESP_OK;
+      } else {
+         esp_mqtt_client_reconnect(_mqtt);
+      }
+   }
+}
+
+static void
+backhaul_mqtt_event(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+   if (id == MQTT_EVENT_CONNECTED) {
+      ESP_LOGI(TAG, "Connected to %s", CONFIG_BACKHAUL_MQTT_URI);
+      __atomic_store_n(&_mqtt_up, 1, __ATOMIC_RELEASE);
+      _mqtt_backoff_ms = BACKHAUL_BACKOFF_MIN_MS;
+      xTaskNotifyGive(_task);  // Replay the spill log
+   } else if (id == MQTT_EVENT_DISCONNECTED) {
+      __atomic_store_n(&_mqtt_up, 0, __ATOMIC_RELEASE);
+      if (__atomic_load_n(&_wifi_up, __ATOMIC_ACQUIRE)) backhaul_retry(_mqtt_timer, &_mqtt_backoff_ms);
+   }
+}
+
+/**
+ * Move up to CONFIG_BACKHAUL_BATCH_MAX readings from the telemetry ring
+ * into the batch buffer.
+ * @return Batch size in bytes, 0 if there was nothing to send.
+ */
+static int
+backhaul_collect(void)
+{
+   backhaul_batch_t *hdr = (backhaul_batch_t *)_batch;
+   telemetry_record_t *out = (telemetry_record_t *)(_batch + sizeof(*hdr));
+   const telemetry_record_t *recs;
+   int count = 0;
+   int n;
+
+   while (count < CONFIG_BACKHAUL_BATCH_MAX && (n = telemetry_peek(&recs, CONFIG_BACKHAUL_BATCH_MAX - count)) > 0) {
+      memcpy(out + count, recs, n * sizeof(*recs));
+      telemetry_release(n);
+      count += n;
+   }
+   if (count == 0) return 0;
+
+   hdr->version = BACKHAUL_FORMAT_VERSION;
+   hdr->count = count;
+   hdr->flags = telemetry_take_alerts() > 0 ? BACKHAUL_ALERT : 0;
+   hdr->seq = _seq++;
+   return sizeof(*hdr) + count * sizeof(*recs);
+}
+
+/**
+ * Publish one batch.
+ * @return Non-zero if the client accepted it.
+ */
+static int
+backhaul_publish(const uint8_t *buf, int len)
+{
+   if (!backhaul_connected()) return 0;
+   return esp_mqtt_client_publish(_mqtt, CONFIG_BACKHAUL_MQTT_TOPIC, (const char *)buf, len, BACKHAUL_QOS, 0) >= 0;
+}
+
+static void
+backhaul_task(void *pvParameters)
+{
+   while (1) {
+      if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BACKHAUL_FLUSH_TIMEOUT_MS)) == 0 && telemetry_alerts_held()) continue;
+
+      /*
+       * Spilled batches first, oldest first.
+       */
+      int len;
+      while (backhaul_connected() && (len = spill_read(_batch, sizeof(_batch))) > 0) {
+         ((backhaul_batch_t *)_batch)->flags |= BACKHAUL_REPLAYED;
+         if (!backhaul_publish(_batch, len)) break;
+         spill_consume();
+      }
+
+      while ((len = backhaul_collect()) > 0) {
+         if (backhaul_publish(_batch, len)) continue;
+         if (!spill_write(_batch, len)) {
+            ESP_LOGW(TAG, "Backhaul down, batch %d (%d readings) lost", (int)((backhaul_batch_t *)_batch)->seq, ((backhaul_batch_t *)_batch)->count);
+         }
+      }
+   }
+}
+
+/**
+ * Bring up Wi-Fi and the MQTT client and start the backhaul task.
+ * NVS must be initialized before (nvs_flash_init()).
+ * @return Non-zero on success.
+ */
+int
+backhaul_start(void)
+{
+   spill_init();
+
+   if (esp_netif_init() != ESP_OK) return 0;
+   esp_err_t ret = esp_event_loop_create_default();
+   if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) return 0;
+   esp_netif_create_default_wifi_sta();
+
+   wifi_init_config_t init = WIFI_INIT_CONFIG_DEFAULT();
+   if (esp_wifi_init(&init) != ESP_OK) return 0;
+   esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &backhaul_wifi_event, NULL);
+   esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &backhaul_wifi_event, NULL);
+
+   wifi_config_t wifi = {
+      .sta = {
+         .ssid = CONFIG_BACKHAUL_WIFI_SSID,
+         .password = CONFIG_BACKHAUL_WIFI_PASSWORD,
+      },
+   };
+   esp_wifi_set_mode(WIFI_MODE_STA);
+   esp_wifi_set_config(WIFI_IF_STA, &wifi);
+
+   esp_mqtt_client_config_t mqtt = {
+      .broker.address.uri = CONFIG_BACKHAUL_MQTT_URI,
+      .network.disable_auto_reconnect = true,  // Reconnects use the backoff timer
+   };
+   _mqtt = esp_mqtt_client_init(&mqtt);
+   if (_mqtt == NULL) return 0;
+   esp_mqtt_client_register_event(_mqtt, ESP_EVENT_ANY_ID, &backhaul_mqtt_event, NULL);
+
+   const esp_timer_create_args_t wifi_timer = { .callback = &backhaul_wifi_retry, .name = "wifi_retry" };
+   const esp_timer_create_args_t mqtt_timer = { .callback = &backhaul_mqtt_retry, .name = "mqtt_retry" };
+   if (esp_timer_create(&wifi_timer, &_wifi_timer) != ESP_OK) return 0;
+   if (esp_timer_create(&mqtt_timer, &_mqtt_timer) != ESP_OK) return 0;
+
+   if (xTaskCreatePinnedToCore(&backhaul_task, "Backhaul", BACKHAUL_TASK_STACK, NULL,
+                               BACKHAUL_TASK_PRIORITY, &_task, CONFIG_BACKHAUL_TASK_CORE) != pdPASS) return 0;
+   telemetry_set_alert_handler(backhaul_flush);
+   return esp_wifi_start() == ESP_OK;
+}
+
+/**
+ * Signal the end of a gateway cycle: the buffered readings are published
+ * as one batch. Never blocks.
+ */
+void
+backhaul_flush(void)
+{
+   if (_task) xTaskNotifyGive(_task);
+}
+
+/**
+ * Returns non-zero while the MQTT session is up.
+ */
+int
+backhaul_connected(void)
+{
+   return __atomic_load_n(&_mqtt_up, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,28 @@
+#ifndef __BACKHAUL_H__
+#define __BACKHAUL_H__
+
+#include <stdint.h>
+#include "telemetry.h"
+
+#define BACKHAUL_FORMAT_VERSION        1
+
+// Batch flags
+#define BACKHAUL_REPLAYED              0x01     // Published from the flash spill log
+#define BACKHAUL_ALERT                 0x02     // Published ahead of the cycle end for an alert
+
+/*
+ * Publish payload: this header followed by count telemetry_record_t,
+ * little-endian, as laid out in telemetry.h.
+ */
+typedef struct __attribute__((packed)) {
+   uint8_t version;                    // BACKHAUL_FORMAT_VERSION
+   uint8_t count;
+   uint16_t flags;
+   uint32_t seq;                       // Batch number since boot
+} backhaul_batch_t;
+
+int backhaul_start(void);
+void backhaul_flush(void);
+int backhaul_connected(void);
+
+#endif
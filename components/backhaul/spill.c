@@ -0,0 +1,155 @@
+#include <stddef.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#include "spill.h"
+
+/*
+ * Offline spill log.
+ * Batches that could not be published are appended to the "spill" data
+ * partition in fixed-size slots, each with a sequence number. A published
+ * batch is marked by clearing its header's sent byte (1 -> 0 bits need no
+ * erase), and a sector is erased only when the log wraps onto it, so every
+ * sector sees one erase per lap. The log is rebuilt from the slot headers
+ * at boot. When the partition is full the oldest batches are overwritten.
+ */
+
+#define SPILL_PARTITION_LABEL          "spill"
+#define SPILL_SECTOR_SIZE              4096
+#define SPILL_SLOTS_PER_SECTOR         (SPILL_SECTOR_SIZE / SPILL_SLOT_SIZE)
+#define SPILL_MAGIC                    0xa5
+#define SPILL_FREE_SEQ                 0xffffffff
+
+#define TAG "SPILL"
+
+typedef struct __attribute__((packed)) {
+   uint32_t seq;
+   uint16_t len;
+   uint8_t magic;
+   uint8_t sent;                       // 0xff until published, then 0x00
+} spill_hdr_t;
+
+_Static_assert(sizeof(spill_hdr_t) + SPILL_MAX_PAYLOAD == SPILL_SLOT_SIZE, "spill slot layout");
+
+static const esp_partition_t *_part = NULL;
+static uint32_t _slots = 0;
+static uint32_t _head_seq = 0;         // Next sequence number to write
+static uint32_t _tail_seq = 0;         // Oldest sequence number not yet published
+
+static inline uint32_t
+spill_offset(uint32_t seq)
+{
+   return (seq % _slots) * SPILL_SLOT_SIZE;
+}
+
+/**
+ * Find the partition and rebuild the log state from the slot headers.
+ * @return Non-zero if spilling is available.
+ */
+int
+spill_init(void)
+{
+   _part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SPILL_PARTITION_LABEL);
+   if (_part == NULL) {
+      ESP_LOGW(TAG, "No \"%s\" partition, offline buffering disabled", SPILL_PARTITION_LABEL);
+      return 0;
+   }
+   _slots = (_part->size / SPILL_SECTOR_SIZE) * SPILL_SLOTS_PER_SECTOR;
+
+   int found = 0;
+   uint32_t newest = 0, oldest_unsent = SPILL_FREE_SEQ;
+   for (uint32_t slot = 0; slot < _slots; slot++) {
+      spill_hdr_t hdr;
+      if (esp_partition_read(_part, slot * SPILL_SLOT_SIZE, &hdr, sizeof(hdr)) != ESP_OK) continue;
+      if (hdr.magic != SPILL_MAGIC || hdr.seq == SPILL_FREE_SEQ || hdr.seq % _slots != slot) continue;
+      if (!found || hdr.seq > newest) newest = hdr.seq;
+      if (hdr.sent == 0xff && hdr.seq < oldest_unsent) oldest_unsent = hdr.seq;
+      found = 1;
+   }
+
+   _head_seq = found ? newest + 1 : 0;
+   _tail_seq = oldest_unsent != SPILL_FREE_SEQ ? oldest_unsent : _head_seq;
+   ESP_LOGI(TAG, "%d slots, %d batches pending", (int)_slots, spill_pending());
+   return 1;
+}
+
+/**
+ * Append a batch.
+ * @param buf Batch to store.
+ * @param len Batch size, at most SPILL_MAX_PAYLOAD.
+ * @return Non-zero if stored.
+ */
+int
+spill_write(const uint8_t *buf, int len)
+{
+   static uint8_t slot[SPILL_SLOT_SIZE];
+   if (_part == NULL || len > SPILL_MAX_PAYLOAD) return 0;
+
+   uint32_t offset = spill_offset(_head_seq);
+   if (offset % SPILL_SECTOR_SIZE == 0) {
+      if (esp_partition_erase_range(_part, offset, SPILL_SECTOR_SIZE) != ESP_OK) return 0;
+      // Batches still pending in the erased sector are lost
+      uint32_t lap_start = _head_seq >= _slots ? _head_seq - _slots + SPILL_SLOTS_PER_SECTOR : 0;
+      if (_tail_seq < lap_start) {
+         ESP_LOGW(TAG, "Log full, %d oldest batches dropped", (int)(lap_start - _tail_seq));
+         _tail_seq = lap_start;
+      }
+   }
+
+   spill_hdr_t *hdr = (spill_hdr_t *)slot;
+   hdr->seq = _head_seq;
+   hdr->len = len;
+   hdr->magic = SPILL_MAGIC;
+   hdr->sent = 0xff;
+   memcpy(slot + sizeof(spill_hdr_t), buf, len);
+   if (esp_partition_write(_part, offset, slot, sizeof(spill_hdr_t) + len) != ESP_OK) return 0;
+   _head_seq++;
+   return 1;
+}
+
+/**
+ * Read the oldest pending batch, see spill_consume().
+ * @param buf Buffer for the batch.
+ * @param size Buffer size.
+ * @return Batch size, 0 if nothing is pending.
+ */
+int
+spill_read(uint8_t *buf, int size)
+{
+   spill_hdr_t hdr;
+
+   while (spill_pending() > 0) {
+      uint32_t offset = spill_offset(_tail_seq);
+      if (esp_partition_read(_part, offset, &hdr, sizeof(hdr)) == ESP_OK &&
+          hdr.magic == SPILL_MAGIC && hdr.seq == _tail_seq && hdr.len <= size &&
+          esp_partition_read(_part, offset + sizeof(hdr), buf, hdr.len) == ESP_OK) {
+         return hdr.len;
+      }
+      ESP_LOGW(TAG, "Batch %d unreadable, skipped", (int)_tail_seq);
+      _tail_seq++;
+   }
+   return 0;
+}
+
+/**
+ * Mark the batch returned by spill_read() as published.
+ */
+void
+spill_consume(void)
+{
+   uint8_t sent = 0x00;
+
+   if (spill_pending() == 0) return;
+   esp_partition_write(_part, spill_offset(_tail_seq) + offsetof(spill_hdr_t, sent), &sent, 1);
+   _tail_seq++;
+}
+
+/**
+ * Return the number of batches waiting in flash.
+ */
+int
+spill_pending(void)
+{
+   return _head_seq - _tail_seq;
+}
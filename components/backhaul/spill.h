@@ -0,0 +1,15 @@
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include <stdint.h>
+
+#define SPILL_SLOT_SIZE                1024
+#define SPILL_MAX_PAYLOAD              (SPILL_SLOT_SIZE - 8)
+
+int spill_init(void);
+int spill_write(const uint8_t *buf, int len);
+int spill_read(uint8_t *buf, int size);
+void spill_consume(void);
+int spill_pending(void);
+
+#endif
@@ -1,39 +1,112 @@
 #ifndef __LORA_H__
 #define __LORA_H__
 
-void lora_reset(void);
-void lora_explicit_header_mode(void);
-void lora_implicit_header_mode(int size);
-void lora_idle(void);
-void lora_sleep(void); 
-void lora_receive(void);
-int lora_get_irq(void);
-void lora_set_tx_power(int level);
-void lora_set_frequency(long frequency);
-void lora_set_spreading_factor(int sf);
-int lora_get_spreading_factor(void);
-void lora_set_dio_mapping(int dio, int mode);
-int lora_get_dio_mapping(int dio);
-void lora_set_bandwidth(int sbw);
-int lora_get_bandwidth(void);
-void lora_set_coding_rate(int cr);
-int lora_get_coding_rate(void);
-void lora_set_preamble_length(long length);
-long lora_get_preamble_length(void);
-void lora_set_sync_word(int sw);
-void lora_enable_crc(void);
-void lora_disable_crc(void);
-int lora_init(void);
-void lora_send_packet(uint8_t *buf, int size);
-int lora_receive_packet(uint8_t *buf, int size);
-int lora_received(void);
-int lora_packet_lost(void);
-int lora_packet_rssi(void);
-float lora_packet_snr(void);
-void lora_close(void);
-int lora_initialized(void);
-void lora_dump_registers(void);
-
-int lora_read_reg(int reg);//add
+#include <stdint.h>
+
+// LowDataRateOptimize is mandated above this symbol time
+#define LORA_LDRO_SYMBOL_US 16000
+
+// Chip reset values the driver keeps unless told otherwise
+#define LORA_DEFAULT_PREAMBLE 8
+#define LORA_DEFAULT_BW 7
+
+/*
+ * One radio, returned by lora_init(). Every other driver function takes it
+ * as its first argument.
+ */
+typedef struct lora_dev lora_dev_t;
+
+/*
+ * Pins of one radio. MISO, MOSI and SCK are shared by all radios, see
+ * CONFIG_MISO_GPIO, CONFIG_MOSI_GPIO and CONFIG_SCK_GPIO.
+ */
+typedef struct {
+   int cs_gpio;
+   int rst_gpio;
+   int dio0_gpio;    // -1 if not wired: REG_IRQ_FLAGS is then polled every tick
+} lora_pins_t;
+
+/*
+ * Complete modem configuration, see lora_apply_profile().
+ */
+typedef struct {
+   long frequency;   // Carrier frequency in Hz
+   int sf;           // Spreading factor (6 to 12)
+   int bw;           // Signal bandwidth (0 to 9)
+   int cr;           // Coding rate (1 to 4)
+   int crc;          // Non-zero to append/verify the payload CRC
+   int tx_power;     // 2-17, 0 keeps the current level
+   int implicit_len; // Implicit header with this payload length, 0 for explicit header
+} lora_profile_t;
+
+/*
+ * Driver counters, see lora_get_stats().
+ */
+typedef struct {
+   uint32_t rx_ok;
+   uint32_t rx_crc_error;
+   uint32_t rx_truncated;  // Longer than the caller's buffer, cut to fit
+   uint32_t tx_ok;
+   uint32_t tx_timeout;    // No TX done within the time on air
+   uint32_t cad_busy;      // Channel found busy by lora_channel_free()
+   uint32_t spi_transfers; // CONFIG_LORA_SPI_STATS only
+   uint64_t spi_busy_us;   // Time spent in SPI transactions, CONFIG_LORA_SPI_STATS only
+} lora_stats_t;
+
+void lora_reset(lora_dev_t *dev);
+void lora_explicit_header_mode(lora_dev_t *dev);
+void lora_implicit_header_mode(lora_dev_t *dev, int size);
+void lora_idle(lora_dev_t *dev);
+void lora_sleep(lora_dev_t *dev);
+void lora_receive(lora_dev_t *dev);
+int lora_get_irq(lora_dev_t *dev);
+void lora_set_tx_power(lora_dev_t *dev, int level);
+void lora_set_frequency(lora_dev_t *dev, long frequency);
+void lora_set_spreading_factor(lora_dev_t *dev, int sf);
+int lora_get_spreading_factor(lora_dev_t *dev);
+void lora_set_dio_mapping(lora_dev_t *dev, int dio, int mode);
+int lora_get_dio_mapping(lora_dev_t *dev, int dio);
+void lora_set_bandwidth(lora_dev_t *dev, int sbw);
+int lora_get_bandwidth(lora_dev_t *dev);
+long lora_bandwidth_hz(int sbw);
+long lora_symbol_time_us(int sf, int sbw);
+long lora_airtime_us(int sf, int sbw, int cr, int crc, int implicit, long preamble, int len);
+void lora_set_coding_rate(lora_dev_t *dev, int cr);
+int lora_get_coding_rate(lora_dev_t *dev);
+void lora_set_preamble_length(lora_dev_t *dev, long length);
+long lora_get_preamble_length(lora_dev_t *dev);
+void lora_set_sync_word(lora_dev_t *dev, int sw);
+void lora_enable_crc(lora_dev_t *dev);
+void lora_disable_crc(lora_dev_t *dev);
+void lora_apply_profile(lora_dev_t *dev, const lora_profile_t *profile);
+long lora_time_on_air_us(lora_dev_t *dev, int len);
+long lora_profile_time_on_air_us(const lora_profile_t *profile, int len);
+lora_dev_t *lora_init(const lora_pins_t *pins);
+int lora_set_spi_clock(lora_dev_t *dev, int hz);
+struct spi_device_t *lora_spi_device(lora_dev_t *dev);
+int lora_send_packet(lora_dev_t *dev, uint8_t *buf, int size);
+int lora_receive_packet(lora_dev_t *dev, uint8_t *buf, int size);
+int lora_received(lora_dev_t *dev);
+int lora_wait_rx(lora_dev_t *dev, int timeout_ms);
+int lora_wait_tx_done(lora_dev_t *dev, int timeout_ms);
+int lora_channel_free(lora_dev_t *dev);
+void lora_wait_event(lora_dev_t *dev, int timeout_ms);
+void lora_wake(lora_dev_t *dev);
+int lora_packet_lost(lora_dev_t *dev);
+void lora_get_stats(lora_dev_t *dev, lora_stats_t *stats);
+void lora_clear_stats(lora_dev_t *dev);
+int lora_packet_rssi(lora_dev_t *dev);
+float lora_packet_snr(lora_dev_t *dev);
+void lora_close(lora_dev_t *dev);
+int lora_initialized(lora_dev_t *dev);
+void lora_dump_registers(lora_dev_t *dev);
+void lora_dump_stats(lora_dev_t *dev);
+
+int lora_read_reg(lora_dev_t *dev, int reg);
+void lora_write_reg(lora_dev_t *dev, int reg, int val);
+void lora_read_reg_buffer(lora_dev_t *dev, int reg, uint8_t *val, int len);
+void lora_write_reg_buffer(lora_dev_t *dev, int reg, uint8_t *val, int len);
+void lora_batch_begin(lora_dev_t *dev);
+void lora_batch_end(lora_dev_t *dev);
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef __LORA_RADIO_H__
+#define __LORA_RADIO_H__
+
+#include <stdint.h>
+#include "lora.h"
+
+#define LORA_MAX_PAYLOAD 255
+
+/*
+ * Roles of a radio, see lora_radio_start().
+ */
+#define LORA_RADIO_RX 0x01
+#define LORA_RADIO_TX 0x02
+
+typedef struct lora_radio lora_radio_t;
+
+/*
+ * Fixed-size packet descriptor exchanged with the radio task.
+ * payload has room for a terminating '\0' after a full-size packet.
+ */
+typedef struct {
+   uint8_t payload[LORA_MAX_PAYLOAD + 1];
+   uint8_t len;
+   int16_t rssi;         // dBm, received packets only
+   float snr;            // dB, received packets only
+   int64_t timestamp_us; // esp_timer time the packet was read from the radio
+   uint8_t radio;        // Index of the receiving radio, in lora_radio_start() order
+} lora_packet_t;
+
+lora_radio_t *lora_radio_start(lora_dev_t *dev, int roles);
+int lora_radio_send(lora_radio_t *radio, const uint8_t *buf, int len, int timeout_ms);
+int lora_radio_set_profile(lora_radio_t *radio, const lora_profile_t *profile, int timeout_ms);
+int lora_radio_set_roles(lora_radio_t *radio, int roles, int timeout_ms);
+int lora_radio_sleep(lora_radio_t *radio, int sleep, int timeout_ms);
+int64_t lora_radio_flush(lora_radio_t *radio, int timeout_ms);
+int lora_radio_hold(lora_radio_t *radio);
+void lora_radio_release(lora_radio_t *radio);
+int lora_radio_receive(lora_packet_t *pkt, int timeout_ms);
+int lora_radio_dropped(lora_radio_t *radio);
+lora_dev_t *lora_radio_dev(lora_radio_t *radio);
+
+#endif
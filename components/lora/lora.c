@@ -1,11 +1,17 @@
 #include <string.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
 
+#include "lora.h"
+
 /*
  * Register definitions
  */
@@ -22,6 +28,7 @@
 #define REG_FIFO_RX_CURRENT_ADDR       0x10
 #define REG_IRQ_FLAGS                  0x12
 #define REG_RX_NB_BYTES                0x13
+#define REG_MODEM_STAT                 0x18
 #define REG_PKT_SNR_VALUE              0x19
 #define REG_PKT_RSSI_VALUE             0x1a
 #define REG_MODEM_CONFIG_1             0x1d
@@ -47,6 +54,7 @@
 #define MODE_TX                        0x03
 #define MODE_RX_CONTINUOUS             0x05
 #define MODE_RX_SINGLE                 0x06
+#define MODE_CAD                       0x07
 
 /*
  * PA configuration
@@ -56,15 +64,37 @@
 /*
  * IRQ masks
  */
+#define IRQ_CAD_DETECTED_MASK          0x01
+#define IRQ_CAD_DONE_MASK              0x04
 #define IRQ_TX_DONE_MASK               0x08
 #define IRQ_PAYLOAD_CRC_ERROR_MASK     0x20
 #define IRQ_RX_DONE_MASK               0x40
 
+/*
+ * DIO0 mapping (REG_DIO_MAPPING_1 bits 7-6)
+ */
+#define DIO0_RX_DONE                   0
+#define DIO0_TX_DONE                   1
+#define DIO0_CAD_DONE                  2
+
+/*
+ * Modem status
+ */
+#define MODEM_STAT_SIGNAL_DETECTED     0x01
+
 #define PA_OUTPUT_RFO_PIN              0
 #define PA_OUTPUT_PA_BOOST_PIN         1
 
 #define TIMEOUT_RESET                  100
 
+// TX done timeout on top of the computed time on air
+#define TX_TIMEOUT_MARGIN_MS           20
+
+// CAD done timeout on top of the two symbols it listens for
+#define CAD_TIMEOUT_MARGIN_MS          5
+
+#define MS_TO_TICKS_CEIL(ms)           (((ms) + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS)
+
 // SPI Stuff
 #if CONFIG_SPI2_HOST
 #define HOST_ID SPI2_HOST
@@ -73,81 +103,208 @@
 #endif
 
 
+// SPI transactions in flight at once, see lora_batch_begin()
+#define SPI_QUEUE_SIZE                 7
+
 #define TAG "LORA"
 
-static spi_device_handle_t _spi;
-static int _implicit;
-static long _frequency;
-static int _send_packet_lost = 0;
-static int _cr = 0;
-static int _sbw = 0;
-static int _sf = 0;
+#define FIFO_SIZE                      256
+
+/*
+ * One SX127x; see lora_init().
+ * Each radio is driven by one task at a time (see lora_radio.c), which is
+ * all the locking there is.
+ */
+struct lora_dev {
+   spi_device_handle_t spi;
+   spi_device_interface_config_t spi_cfg;
+   lora_pins_t pins;
+   int implicit;                  // Implicit header payload length, 0 in explicit mode
+   long frequency;
+   int cr;
+   int sbw;
+   int sf;
+   int mode;                      // Last operating mode written, -1 if unknown
+   long preamble;
+   long symbol_us;
+   SemaphoreHandle_t dio0_sem;
+   lora_stats_t stats;
+
+   /*
+    * Shadow copy of the configuration registers.
+    * Loaded once in lora_init(), so setters only write changed values and
+    * getters never touch the bus.
+    */
+   struct {
+      uint8_t frf[3];          // REG_FRF_MSB..REG_FRF_LSB
+      uint8_t pa_config;
+      uint8_t modem_config_1;
+      uint8_t modem_config_2;
+      uint8_t modem_config_3;
+      uint8_t dio_mapping_1;
+      uint8_t dio_mapping_2;
+   } shadow;
 
-// use spi_device_transmit
-#define SPI_TRANSMIT 1
+   /*
+    * DMA-capable scratch buffers for FIFO bursts, sized for the whole FIFO.
+    */
+   uint8_t burst_tx[FIFO_SIZE] __attribute__((aligned(4)));
+   uint8_t burst_rx[FIFO_SIZE] __attribute__((aligned(4)));
 
-// use buffer io
-// A little faster
-#define BUFFER_IO 1
+   /*
+    * Queued transactions, see lora_batch_begin(). They must stay valid
+    * until their result is fetched.
+    */
+   spi_transaction_t queued[SPI_QUEUE_SIZE];
+   int queued_count;              // Queued, results not fetched yet
+   int batch;                     // Non-zero between lora_batch_begin() and lora_batch_end()
+   int burst_queued;              // burst_tx is used by a queued transaction
+#if CONFIG_LORA_SPI_STATS
+   int64_t queued_start;
+#endif
+};
 
+static DMA_ATTR lora_dev_t _devs[CONFIG_LORA_RADIO_COUNT];
+static int _dev_count = 0;
+
+/**
+ * Wait for all queued transactions.
+ * With CONFIG_LORA_SPI_STATS the bus counts as busy from the first one
+ * queued until they are all done.
+ */
+static void
+lora_wait_queued(lora_dev_t *dev)
+{
+   spi_transaction_t *done;
+
+   if (dev->queued_count == 0) return;
+   while (dev->queued_count > 0) {
+      spi_device_get_trans_result(dev->spi, &done, portMAX_DELAY);
+      dev->queued_count--;
+   }
+   dev->burst_queued = 0;
+#if CONFIG_LORA_SPI_STATS
+   dev->stats.spi_busy_us += esp_timer_get_time() - dev->queued_start;
+#endif
+}
+
+/**
+ * Run an SPI transaction, accounting its duration when enabled.
+ * Inside a batch, transactions that return no data are queued and the
+ * call returns at once; any other transaction waits for the queued ones
+ * first, so the bus order is the call order.
+ * @param t Transaction.
+ * @param polling Non-zero to busy-wait instead of blocking on the interrupt.
+ */
+static inline void
+lora_transfer(lora_dev_t *dev, spi_transaction_t *t, int polling)
+{
+   int rx = (t->flags & SPI_TRANS_USE_RXDATA) || t->rx_buffer != NULL;
+
+   if (dev->batch && !rx) {
+      if (dev->queued_count == SPI_QUEUE_SIZE) lora_wait_queued(dev);
+#if CONFIG_LORA_SPI_STATS
+      if (dev->queued_count == 0) dev->queued_start = esp_timer_get_time();
+      dev->stats.spi_transfers++;
+#endif
+      dev->queued[dev->queued_count] = *t;
+      spi_device_queue_trans(dev->spi, &dev->queued[dev->queued_count++], portMAX_DELAY);
+      return;
+   }
+   lora_wait_queued(dev);
+
+#if CONFIG_LORA_SPI_STATS
+   int64_t start = esp_timer_get_time();
+#endif
+   if (polling) spi_device_polling_transmit(dev->spi, t);
+   else spi_device_transmit(dev->spi, t);
+#if CONFIG_LORA_SPI_STATS
+   dev->stats.spi_busy_us += esp_timer_get_time() - start;
+   dev->stats.spi_transfers++;
+#endif
+}
+
+/**
+ * Run a single register transaction.
+ * Polling avoids the interrupt and task switch for these 2-byte transfers.
+ */
+static inline void
+lora_reg_transfer(lora_dev_t *dev, spi_transaction_t *t)
+{
+#if CONFIG_REG_ACCESS_POLLING
+   lora_transfer(dev, t, 1);
+#else
+   lora_transfer(dev, t, 0);
+#endif
+}
 
 /**
  * Write a value to a register.  * @param reg Register index.
  * @param val Value to write.
  */
 void 
-lora_write_reg(int reg, int val)
+lora_write_reg(lora_dev_t *dev, int reg, int val)
 {
-   uint8_t out[2] = { 0x80 | reg, val };
-   uint8_t in[2];
-
    spi_transaction_t t = {
-      .flags = 0,
-      .length = 8 * sizeof(out),
-      .tx_buffer = out,
-      .rx_buffer = in  
+      .flags = SPI_TRANS_USE_TXDATA,
+      .cmd = 0x80 | reg,
+      .length = 8,
+      .tx_data = { (uint8_t)val }
    };
 
-   //gpio_set_level(CONFIG_CS_GPIO, 0);
-#if SPI_TRANSMIT
-   spi_device_transmit(_spi, &t);
-#else
-   spi_device_polling_transmit(_spi, &t);
-#endif
-   //gpio_set_level(CONFIG_CS_GPIO, 1);
+   lora_reg_transfer(dev, &t);
 }
 
 /**
  * Write a buffer to a register.
+ * The address goes out in the command phase, the data straight from the
+ * static DMA buffer.
  * @param reg Register index.
  * @param val Value to write.
- * @param len Byte length to write.
+ * @param len Byte length to write (up to FIFO_SIZE).
  */
 void
-lora_write_reg_buffer(int reg, uint8_t *val, int len)
+lora_write_reg_buffer(lora_dev_t *dev, int reg, uint8_t *val, int len)
 {
-   uint8_t *out;
-   out = (uint8_t *)malloc(len+1);
-   out[0] = 0x80 | reg;
-   for (int i=0;i<len;i++) {
-      out[i+1] = val[i];
-   }
+   if (len <= 0) return;
+   if (len > FIFO_SIZE) len = FIFO_SIZE;
+   if (dev->burst_queued) lora_wait_queued(dev);
+   memcpy(dev->burst_tx, val, len);
 
    spi_transaction_t t = {
       .flags = 0,
-      .length = 8 * (len+1),
-      .tx_buffer = out,
+      .cmd = 0x80 | reg,
+      .length = 8 * len,
+      .tx_buffer = dev->burst_tx,
       .rx_buffer = NULL
    };
 
-   //gpio_set_level(CONFIG_CS_GPIO, 0);
-#if SPI_TRANSMIT
-   spi_device_transmit(_spi, &t);
-#else
-   spi_device_polling_transmit(_spi, &t);
+   lora_transfer(dev, &t, 0);
+   dev->burst_queued = dev->queued_count > 0;
+}
+
+/**
+ * Start a batch: register writes and FIFO bursts are queued back to back
+ * instead of waiting for each one. Register reads, and lora_batch_end(),
+ * wait for the queued transactions first.
+ * Without CONFIG_LORA_SPI_QUEUED this does nothing.
+ */
+void
+lora_batch_begin(lora_dev_t *dev)
+{
+#if CONFIG_LORA_SPI_QUEUED
+   dev->batch = 1;
 #endif
-   //gpio_set_level(CONFIG_CS_GPIO, 1);
-   free(out);
+}
+
+/**
+ * End a batch and wait for its queued transactions.
+ */
+void
+lora_batch_end(lora_dev_t *dev)
+{
+   dev->batch = 0;
+   lora_wait_queued(dev);
 }
 
 /**
@@ -156,77 +313,162 @@ lora_write_reg_buffer(int reg, uint8_t *val, int len)
  * @return Value of the register.
  */
 int
-lora_read_reg(int reg)
+lora_read_reg(lora_dev_t *dev, int reg)
 {
-   uint8_t out[2] = { reg, 0xff };
-   uint8_t in[2];
-
    spi_transaction_t t = {
-      .flags = 0,
-      .length = 8 * sizeof(out),
-      .tx_buffer = out,
-      .rx_buffer = in
+      .flags = SPI_TRANS_USE_RXDATA,
+      .cmd = reg,
+      .length = 8
    };
 
-   //gpio_set_level(CONFIG_CS_GPIO, 0);
-#if SPI_TRANSMIT
-   spi_device_transmit(_spi, &t);
-#else
-   spi_device_polling_transmit(_spi, &t);
-#endif
-   //gpio_set_level(CONFIG_CS_GPIO, 1);
-   return in[1];
+   lora_reg_transfer(dev, &t);
+   return t.rx_data[0];
 }
 
 /**
  * Read the current value of a register.
  * @param reg Register index.
  * @return Value of the register.
- * @param len Byte length to read.
+ * @param len Byte length to read (up to FIFO_SIZE).
  */
 void
-lora_read_reg_buffer(int reg, uint8_t *val, int len)
-{
-   uint8_t *out;
-   uint8_t *in;
-   out = (uint8_t *)malloc(len+1);
-   in = (uint8_t *)malloc(len+1);
-   out[0] = reg;
-   for (int i=0;i<len;i++) {
-      out[i+1] = 0xff;
-   }
+lora_read_reg_buffer(lora_dev_t *dev, int reg, uint8_t *val, int len)
+{
+   if (len <= 0) return;
+   if (len > FIFO_SIZE) len = FIFO_SIZE;
 
+   /*
+    * DMA wants word-sized receive lengths, otherwise the SPI driver
+    * allocates a bounce buffer. The extra bytes are discarded.
+    */
+   int xfer = (len + 3) & ~3;
    spi_transaction_t t = {
       .flags = 0,
-      .length = 8 * (len+1),
-      .tx_buffer = out,
-      .rx_buffer = in
+      .cmd = reg,
+      .length = 8 * xfer,
+      .tx_buffer = NULL,
+      .rx_buffer = dev->burst_rx
    };
 
-   //gpio_set_level(CONFIG_CS_GPIO, 0);
-#if SPI_TRANSMIT
-   spi_device_transmit(_spi, &t);
-#else
-   spi_device_polling_transmit(_spi, &t);
-#endif
-   //gpio_set_level(CONFIG_CS_GPIO, 1);
-   for (int i=0;i<len;i++) {
-      val[i] = in[i+1];
+   lora_transfer(dev, &t, 0);
+   memcpy(val, dev->burst_rx, len);
+}
+
+/**
+ * Write a register through its shadow copy.
+ * The SPI transaction is skipped when the value does not change.
+ * @param reg Register index.
+ * @param shadow Shadow copy of the register.
+ * @param val Value to write.
+ */
+static void
+lora_write_reg_cached(lora_dev_t *dev, int reg, uint8_t *shadow, int val)
+{
+   if (*shadow == (uint8_t)val) return;
+   *shadow = val;
+   lora_write_reg(dev, reg, val);
+}
+
+/**
+ * Recompute the symbol time after an SF or bandwidth change and
+ * set LowDataRateOptimize when symbols are longer than 16 ms.
+ */
+static void
+lora_update_timing(lora_dev_t *dev)
+{
+   dev->symbol_us = lora_symbol_time_us(dev->sf, dev->sbw);
+   int mc3 = dev->shadow.modem_config_3 & ~0x08;
+   if (dev->symbol_us > LORA_LDRO_SYMBOL_US) mc3 |= 0x08;
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_3, &dev->shadow.modem_config_3, mc3);
+}
+
+/**
+ * Load the shadow copy from the chip.
+ * Must be called in LoRa mode: 0x0d-0x3f are FSK registers otherwise.
+ */
+static void
+lora_load_shadow(lora_dev_t *dev)
+{
+   uint8_t rf[4];
+
+   lora_read_reg_buffer(dev, REG_FRF_MSB, rf, sizeof(rf)); // FRF_MSB..PA_CONFIG
+   memcpy(dev->shadow.frf, rf, 3);
+   dev->shadow.pa_config = rf[3];
+   dev->shadow.modem_config_1 = lora_read_reg(dev, REG_MODEM_CONFIG_1);
+   dev->shadow.modem_config_2 = lora_read_reg(dev, REG_MODEM_CONFIG_2);
+   dev->shadow.modem_config_3 = lora_read_reg(dev, REG_MODEM_CONFIG_3);
+   dev->shadow.dio_mapping_1 = lora_read_reg(dev, REG_DIO_MAPPING_1);
+   dev->shadow.dio_mapping_2 = lora_read_reg(dev, REG_DIO_MAPPING_2);
+   dev->preamble = lora_read_reg(dev, REG_PREAMBLE_MSB) << 8 | lora_read_reg(dev, REG_PREAMBLE_LSB);
+
+   dev->implicit = (dev->shadow.modem_config_1 & 0x01) ? lora_read_reg(dev, REG_PAYLOAD_LENGTH) : 0;
+   dev->sbw = dev->shadow.modem_config_1 >> 4;
+   dev->cr = (dev->shadow.modem_config_1 & 0x0e) >> 1;
+   dev->sf = dev->shadow.modem_config_2 >> 4;
+   dev->symbol_us = lora_symbol_time_us(dev->sf, dev->sbw);
+   dev->frequency = (long)((((uint64_t)dev->shadow.frf[0] << 16 | dev->shadow.frf[1] << 8 | dev->shadow.frf[2]) * 32000000) >> 19);
+}
+
+/**
+ * Change the operating mode.
+ * Nothing is written if the radio is already in that mode. TX and CAD
+ * fall back to standby on their own, their callers record it.
+ * @param mode MODE_SLEEP, MODE_STDBY, MODE_TX, MODE_RX_CONTINUOUS or MODE_CAD.
+ */
+static void
+lora_set_mode(lora_dev_t *dev, int mode)
+{
+   if (mode == dev->mode) return;
+   lora_write_reg(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | mode);
+   dev->mode = mode;
+}
+
+/**
+ * DIO0 interrupt handler.
+ * Wakes up the task blocked in lora_wait_rx() / lora_wait_tx_done().
+ */
+static void IRAM_ATTR
+lora_dio0_isr(void *arg)
+{
+   lora_dev_t *dev = arg;
+   BaseType_t woken = pdFALSE;
+   xSemaphoreGiveFromISR(dev->dio0_sem, &woken);
+   if (woken) portYIELD_FROM_ISR();
+}
+
+/**
+ * Wait until one of the given IRQ flags is raised.
+ * Sleeps on the DIO0 interrupt, or polls every tick when DIO0 is not wired.
+ * @param mask IRQ flags to wait for.
+ * @param timeout_ms Maximum time to wait.
+ * @return Non-zero if a flag was raised before the timeout.
+ */
+static int
+lora_wait_irq_flags(lora_dev_t *dev, int mask, int timeout_ms)
+{
+   TickType_t start = xTaskGetTickCount();
+   TickType_t wait = MS_TO_TICKS_CEIL(timeout_ms);
+
+   while ((lora_read_reg(dev, REG_IRQ_FLAGS) & mask) == 0) {
+      TickType_t elapsed = xTaskGetTickCount() - start;
+      if (elapsed >= wait) return 0;
+      if (dev->dio0_sem) xSemaphoreTake(dev->dio0_sem, wait - elapsed);
+      else vTaskDelay(1);
    }
-   free(out);
-   free(in);
+   return 1;
 }
 
 /**
  * Perform physical reset on the Lora chip
  */
 void 
-lora_reset(void)
+lora_reset(lora_dev_t *dev)
 {
-   gpio_set_level(CONFIG_RST_GPIO, 0);
+   gpio_set_level(dev->pins.rst_gpio, 0);
    vTaskDelay(pdMS_TO_TICKS(1));
-   gpio_set_level(CONFIG_RST_GPIO, 1);
+   gpio_set_level(dev->pins.rst_gpio, 1);
    vTaskDelay(pdMS_TO_TICKS(10));
+   dev->mode = -1;
 }
 
 /**
@@ -234,10 +476,10 @@ lora_reset(void)
  * Packet size will be included in the frame.
  */
 void 
-lora_explicit_header_mode(void)
+lora_explicit_header_mode(lora_dev_t *dev)
 {
-   _implicit = 0;
-   lora_write_reg(REG_MODEM_CONFIG_1, lora_read_reg(REG_MODEM_CONFIG_1) & 0xfe);
+   dev->implicit = 0;
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_1, &dev->shadow.modem_config_1, dev->shadow.modem_config_1 & 0xfe);
 }
 
 /**
@@ -246,11 +488,11 @@ lora_explicit_header_mode(void)
  * @param size Size of the packets.
  */
 void 
-lora_implicit_header_mode(int size)
+lora_implicit_header_mode(lora_dev_t *dev, int size)
 {
-   _implicit = 1;
-   lora_write_reg(REG_MODEM_CONFIG_1, lora_read_reg(REG_MODEM_CONFIG_1) | 0x01);
-   lora_write_reg(REG_PAYLOAD_LENGTH, size);
+   dev->implicit = size;
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_1, &dev->shadow.modem_config_1, dev->shadow.modem_config_1 | 0x01);
+   lora_write_reg(dev, REG_PAYLOAD_LENGTH, size);
 }
 
 /**
@@ -258,9 +500,9 @@ lora_implicit_header_mode(int size)
  * Must be used to change registers and access the FIFO.
  */
 void 
-lora_idle(void)
+lora_idle(lora_dev_t *dev)
 {
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_set_mode(dev, MODE_STDBY);
 }
 
 /**
@@ -268,9 +510,9 @@ lora_idle(void)
  * Low power consumption and FIFO is lost.
  */
 void 
-lora_sleep(void)
+lora_sleep(lora_dev_t *dev)
 { 
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
+   lora_set_mode(dev, MODE_SLEEP);
 }
 
 /**
@@ -278,9 +520,10 @@ lora_sleep(void)
  * Incoming packets will be received.
  */
 void 
-lora_receive(void)
+lora_receive(lora_dev_t *dev)
 {
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   lora_set_dio_mapping(dev, 0, DIO0_RX_DONE);
+   lora_set_mode(dev, MODE_RX_CONTINUOUS);
 }
 
 /**
@@ -288,12 +531,12 @@ lora_receive(void)
  * @param level 2-17, from least to most power
  */
 void 
-lora_set_tx_power(int level)
+lora_set_tx_power(lora_dev_t *dev, int level)
 {
    // RF9x module uses PA_BOOST pin
    if (level < 2) level = 2;
    else if (level > 17) level = 17;
-   lora_write_reg(REG_PA_CONFIG, PA_BOOST | (level - 2));
+   lora_write_reg_cached(dev, REG_PA_CONFIG, &dev->shadow.pa_config, PA_BOOST | (level - 2));
 }
 
 /**
@@ -301,15 +544,38 @@ lora_set_tx_power(int level)
  * @param frequency Frequency in Hz
  */
 void 
-lora_set_frequency(long frequency)
+lora_set_frequency(lora_dev_t *dev, long frequency)
 {
-   _frequency = frequency;
+   dev->frequency = frequency;
 
    uint64_t frf = ((uint64_t)frequency << 19) / 32000000;
+   uint8_t val[3] = { (uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)(frf >> 0) };
 
-   lora_write_reg(REG_FRF_MSB, (uint8_t)(frf >> 16));
-   lora_write_reg(REG_FRF_MID, (uint8_t)(frf >> 8));
-   lora_write_reg(REG_FRF_LSB, (uint8_t)(frf >> 0));
+   /*
+    * A new frequency only takes effect when FrfLsb is written, so all
+    * three bytes go out in one burst even if the low byte is unchanged.
+    */
+   if (memcmp(val, dev->shadow.frf, sizeof(val)) == 0) return;
+   lora_write_reg_buffer(dev, REG_FRF_MSB, val, sizeof(val));
+   memcpy(dev->shadow.frf, val, sizeof(val));
+}
+
+/**
+ * Update the detection settings for a new spreading factor.
+ * They only differ for SF6 (reset values match SF7-12).
+ * @param sf 6-12, Spreading factor about to be used.
+ */
+static void
+lora_set_detection(lora_dev_t *dev, int sf)
+{
+   if ((sf == 6) == (dev->sf == 6)) return;
+   if (sf == 6) {
+      lora_write_reg(dev, REG_DETECTION_OPTIMIZE, 0xc5);
+      lora_write_reg(dev, REG_DETECTION_THRESHOLD, 0x0c);
+   } else {
+      lora_write_reg(dev, REG_DETECTION_OPTIMIZE, 0xc3);
+      lora_write_reg(dev, REG_DETECTION_THRESHOLD, 0x0a);
+   }
 }
 
 /**
@@ -317,30 +583,24 @@ lora_set_frequency(long frequency)
  * @param sf 6-12, Spreading factor to use.
  */
 void 
-lora_set_spreading_factor(int sf)
+lora_set_spreading_factor(lora_dev_t *dev, int sf)
 {
    if (sf < 6) sf = 6;
    else if (sf > 12) sf = 12;
 
-   if (sf == 6) {
-      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc5);
-      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0c);
-   } else {
-      lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc3);
-      lora_write_reg(REG_DETECTION_THRESHOLD, 0x0a);
-   }
-
-   lora_write_reg(REG_MODEM_CONFIG_2, (lora_read_reg(REG_MODEM_CONFIG_2) & 0x0f) | ((sf << 4) & 0xf0));
-   _sf = sf;
+   lora_set_detection(dev, sf);
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_2, &dev->shadow.modem_config_2, (dev->shadow.modem_config_2 & 0x0f) | ((sf << 4) & 0xf0));
+   dev->sf = sf;
+   lora_update_timing(dev);
 }
 
 /**
  * Get spreading factor.
  */
 int 
-lora_get_spreading_factor(void)
+lora_get_spreading_factor(lora_dev_t *dev)
 {
-   return (lora_read_reg(REG_MODEM_CONFIG_2) >> 4);
+   return (dev->shadow.modem_config_2 >> 4);
 }
 
 /**
@@ -349,36 +609,36 @@ lora_get_spreading_factor(void)
  * @param mode mode of DIO(0 to 3)
  */
 void 
-lora_set_dio_mapping(int dio, int mode)
+lora_set_dio_mapping(lora_dev_t *dev, int dio, int mode)
 {
    if (dio < 4) {
-      int _mode = lora_read_reg(REG_DIO_MAPPING_1);
+      int map = dev->shadow.dio_mapping_1;
       if (dio == 0) {
-         _mode = _mode & 0x3F;
-         _mode = _mode | (mode << 6);
+         map = map & 0x3F;
+         map = map | (mode << 6);
       } else if (dio == 1) {
-         _mode = _mode & 0xCF;
-         _mode = _mode | (mode << 4);
+         map = map & 0xCF;
+         map = map | (mode << 4);
       } else if (dio == 2) {
-         _mode = _mode & 0xF3;
-         _mode = _mode | (mode << 2);
+         map = map & 0xF3;
+         map = map | (mode << 2);
       } else if (dio == 3) {
-         _mode = _mode & 0xFC;
-         _mode = _mode | mode;
+         map = map & 0xFC;
+         map = map | mode;
       }
-      lora_write_reg(REG_DIO_MAPPING_1, _mode);
-      ESP_LOGD(TAG, "REG_DIO_MAPPING_1=0x%02x", _mode);
+      lora_write_reg_cached(dev, REG_DIO_MAPPING_1, &dev->shadow.dio_mapping_1, map);
+      ESP_LOGD(TAG, "REG_DIO_MAPPING_1=0x%02x", map);
    } else if (dio < 6) {
-      int _mode = lora_read_reg(REG_DIO_MAPPING_2);
+      int map = dev->shadow.dio_mapping_2;
       if (dio == 4) {
-         _mode = _mode & 0x3F;
-         _mode = _mode | (mode << 6);
+         map = map & 0x3F;
+         map = map | (mode << 6);
       } else if (dio == 5) {
-         _mode = _mode & 0xCF;
-         _mode = _mode | (mode << 4);
+         map = map & 0xCF;
+         map = map | (mode << 4);
       }
-      ESP_LOGD(TAG, "REG_DIO_MAPPING_2=0x%02x", _mode);
-      lora_write_reg(REG_DIO_MAPPING_2, _mode);
+      ESP_LOGD(TAG, "REG_DIO_MAPPING_2=0x%02x", map);
+      lora_write_reg_cached(dev, REG_DIO_MAPPING_2, &dev->shadow.dio_mapping_2, map);
    }
 }
 
@@ -387,27 +647,27 @@ lora_set_dio_mapping(int dio, int mode)
  * @param dio Number of DIO(0 to 5)
  */
 int 
-lora_get_dio_mapping(int dio)
+lora_get_dio_mapping(lora_dev_t *dev, int dio)
 {
    if (dio < 4) {
-      int _mode = lora_read_reg(REG_DIO_MAPPING_1);
-      ESP_LOGD(TAG, "REG_DIO_MAPPING_1=0x%02x", _mode);
+      int map = dev->shadow.dio_mapping_1;
+      ESP_LOGD(TAG, "REG_DIO_MAPPING_1=0x%02x", map);
       if (dio == 0) {
-         return ((_mode >> 6) & 0x03);
+         return ((map >> 6) & 0x03);
       } else if (dio == 1) {
-         return ((_mode >> 4) & 0x03);
+         return ((map >> 4) & 0x03);
       } else if (dio == 2) {
-         return ((_mode >> 2) & 0x03);
+         return ((map >> 2) & 0x03);
       } else if (dio == 3) {
-         return (_mode & 0x03);
+         return (map & 0x03);
       }
    } else if (dio < 6) {
-      int _mode = lora_read_reg(REG_DIO_MAPPING_2);
-      ESP_LOGD(TAG, "REG_DIO_MAPPING_2=0x%02x", _mode);
+      int map = dev->shadow.dio_mapping_2;
+      ESP_LOGD(TAG, "REG_DIO_MAPPING_2=0x%02x", map);
       if (dio == 4) {
-         return ((_mode >> 6) & 0x03);
+         return ((map >> 6) & 0x03);
       } else if (dio == 5) {
-         return ((_mode >> 4) & 0x03);
+         return ((map >> 4) & 0x03);
       }
    }
    return 0;
@@ -418,11 +678,12 @@ lora_get_dio_mapping(int dio)
  * @param sbw Signal bandwidth(0 to 9)
  */
 void 
-lora_set_bandwidth(int sbw)
+lora_set_bandwidth(lora_dev_t *dev, int sbw)
 {
    if (sbw < 10) {
-      lora_write_reg(REG_MODEM_CONFIG_1, (lora_read_reg(REG_MODEM_CONFIG_1) & 0x0f) | (sbw << 4));
-      _sbw = sbw;
+      lora_write_reg_cached(dev, REG_MODEM_CONFIG_1, &dev->shadow.modem_config_1, (dev->shadow.modem_config_1 & 0x0f) | (sbw << 4));
+      dev->sbw = sbw;
+      lora_update_timing(dev);
    }
 }
 
@@ -431,14 +692,14 @@ lora_set_bandwidth(int sbw)
  * @param sbw Signal bandwidth(0 to 9)
  */
 int 
-lora_get_bandwidth(void)
+lora_get_bandwidth(lora_dev_t *dev)
 {
    //int bw;
    //bw = lora_read_reg(REG_MODEM_CONFIG_1) & 0xf0;
    //ESP_LOGD(TAG, "bw=0x%02x", bw);
    //bw = bw >> 4;
    //return bw;
-   return ((lora_read_reg(REG_MODEM_CONFIG_1) & 0xf0) >> 4);
+   return ((dev->shadow.modem_config_1 & 0xf0) >> 4);
 }
 
 /**
@@ -446,7 +707,7 @@ lora_get_bandwidth(void)
  * @param cr Coding Rate(1 to 4)
  */ 
 void 
-lora_set_coding_rate(int cr)
+lora_set_coding_rate(lora_dev_t *dev, int cr)
 {
    //if (denominator < 5) denominator = 5;
    //else if (denominator > 8) denominator = 8;
@@ -454,17 +715,17 @@ lora_set_coding_rate(int cr)
    //int cr = denominator - 4;
    if (cr < 1) cr = 1;
    else if (cr > 4) cr = 4;
-   lora_write_reg(REG_MODEM_CONFIG_1, (lora_read_reg(REG_MODEM_CONFIG_1) & 0xf1) | (cr << 1));
-   _cr = cr;
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_1, &dev->shadow.modem_config_1, (dev->shadow.modem_config_1 & 0xf1) | (cr << 1));
+   dev->cr = cr;
 }
 
 /**
  * Get coding rate 
  */ 
 int 
-lora_get_coding_rate(void)
+lora_get_coding_rate(lora_dev_t *dev)
 {
-   return ((lora_read_reg(REG_MODEM_CONFIG_1) & 0x0E) >> 1);
+   return ((dev->shadow.modem_config_1 & 0x0E) >> 1);
 }
 
 /**
@@ -472,22 +733,20 @@ lora_get_coding_rate(void)
  * @param length Preamble length in symbols.
  */
 void 
-lora_set_preamble_length(long length)
+lora_set_preamble_length(lora_dev_t *dev, long length)
 {
-   lora_write_reg(REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
-   lora_write_reg(REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
+   lora_write_reg(dev, REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
+   lora_write_reg(dev, REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
+   dev->preamble = length;
 }
 
 /**
  * Get the size of preamble.
  */
 long
-lora_get_preamble_length(void)
+lora_get_preamble_length(lora_dev_t *dev)
 {
-   long preamble;
-   preamble = lora_read_reg(REG_PREAMBLE_MSB) << 8;
-   preamble = preamble + lora_read_reg(REG_PREAMBLE_LSB);
-   return preamble;
+   return dev->preamble;
 }
 
 /**
@@ -495,75 +754,179 @@ lora_get_preamble_length(void)
  * @param sw New sync word to use.
  */
 void 
-lora_set_sync_word(int sw)
+lora_set_sync_word(lora_dev_t *dev, int sw)
 {
-   lora_write_reg(REG_SYNC_WORD, sw);
+   lora_write_reg(dev, REG_SYNC_WORD, sw);
 }
 
 /**
  * Enable appending/verifying packet CRC.
  */
 void 
-lora_enable_crc(void)
+lora_enable_crc(lora_dev_t *dev)
 {
-   lora_write_reg(REG_MODEM_CONFIG_2, lora_read_reg(REG_MODEM_CONFIG_2) | 0x04);
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_2, &dev->shadow.modem_config_2, dev->shadow.modem_config_2 | 0x04);
 }
 
 /**
  * Disable appending/verifying packet CRC.
  */
 void 
-lora_disable_crc(void)
+lora_disable_crc(lora_dev_t *dev)
 {
-   lora_write_reg(REG_MODEM_CONFIG_2, lora_read_reg(REG_MODEM_CONFIG_2) & 0xfb);
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_2, &dev->shadow.modem_config_2, dev->shadow.modem_config_2 & 0xfb);
 }
 
 /**
- * Perform hardware initialization.
+ * Apply a complete modem profile.
+ * The register image is computed from the shadow copy and each contiguous
+ * group that changed (FRF_MSB..PA_CONFIG, MODEM_CONFIG_1..2) is written
+ * in one burst. A receiving radio is put in standby only for the writes.
+ * The header mode is part of the profile, so a slot scheduler can switch
+ * between fixed-size implicit frames and explicit control traffic.
+ * @param profile Profile to apply.
  */
-int 
-lora_init(void)
+void
+lora_apply_profile(lora_dev_t *dev, const lora_profile_t *profile)
 {
-   esp_err_t ret;
+   uint8_t rf[4];
+   uint8_t mc[2];
+   int sf = profile->sf;
+   int sbw = profile->bw;
+   int cr = profile->cr;
+   uint64_t frf = ((uint64_t)profile->frequency << 19) / 32000000;
+
+   if (sf < 6) sf = 6;
+   else if (sf > 12) sf = 12;
+   if (sbw < 0 || sbw > 9) sbw = dev->sbw;
+   if (cr < 1) cr = 1;
+   else if (cr > 4) cr = 4;
+
+   rf[0] = (uint8_t)(frf >> 16);
+   rf[1] = (uint8_t)(frf >> 8);
+   rf[2] = (uint8_t)(frf >> 0);
+   rf[3] = dev->shadow.pa_config;
+   if (profile->tx_power) {
+      int level = profile->tx_power;
+      if (level < 2) level = 2;
+      else if (level > 17) level = 17;
+      rf[3] = PA_BOOST | (level - 2);
+   }
+   int implicit = profile->implicit_len > 0 && profile->implicit_len < FIFO_SIZE ? profile->implicit_len : 0;
+   mc[0] = (sbw << 4) | (cr << 1) | (implicit ? 0x01 : 0x00);
+   mc[1] = (sf << 4) | (profile->crc ? 0x04 : 0x00) | (dev->shadow.modem_config_2 & 0x0b);
+
+   int rf_dirty = memcmp(rf, dev->shadow.frf, 3) != 0 || rf[3] != dev->shadow.pa_config;
+   int mc_dirty = mc[0] != dev->shadow.modem_config_1 || mc[1] != dev->shadow.modem_config_2;
+   int det_dirty = (sf == 6) != (dev->sf == 6);
+   int len_dirty = implicit && implicit != dev->implicit;
+   if (!rf_dirty && !mc_dirty && !det_dirty && !len_dirty) return;
 
    /*
-    * Configure CPU hardware to communicate with the radio chip
+    * FRF can only be changed in sleep or standby mode.
     */
-   gpio_reset_pin(CONFIG_RST_GPIO);
-   gpio_set_direction(CONFIG_RST_GPIO, GPIO_MODE_OUTPUT);
-   gpio_reset_pin(CONFIG_CS_GPIO);
-   gpio_set_direction(CONFIG_CS_GPIO, GPIO_MODE_OUTPUT);
-   gpio_set_level(CONFIG_CS_GPIO, 1);
-
-   spi_bus_config_t bus = {
-      .miso_io_num = CONFIG_MISO_GPIO,
-      .mosi_io_num = CONFIG_MOSI_GPIO,
-      .sclk_io_num = CONFIG_SCK_GPIO,
-      .quadwp_io_num = -1,
-      .quadhd_io_num = -1,
-      .max_transfer_sz = 0
-   };
-           
-   //ret = spi_bus_initialize(VSPI_HOST, &bus, 0);
-   ret = spi_bus_initialize(HOST_ID, &bus, SPI_DMA_CH_AUTO);
-   assert(ret == ESP_OK);
+   int mode = dev->mode;
+   int rx = mode == MODE_RX_CONTINUOUS || mode == MODE_RX_SINGLE;
+   lora_batch_begin(dev);
+   if (rx) lora_idle(dev);
+
+   if (rf_dirty) {
+      lora_write_reg_buffer(dev, REG_FRF_MSB, rf, sizeof(rf));
+      memcpy(dev->shadow.frf, rf, 3);
+      dev->shadow.pa_config = rf[3];
+   }
+   if (mc_dirty) {
+      lora_write_reg_buffer(dev, REG_MODEM_CONFIG_1, mc, sizeof(mc));
+      dev->shadow.modem_config_1 = mc[0];
+      dev->shadow.modem_config_2 = mc[1];
+   }
+   if (len_dirty) lora_write_reg(dev, REG_PAYLOAD_LENGTH, implicit);
+   lora_set_detection(dev, sf);
+
+   dev->frequency = profile->frequency;
+   dev->sf = sf;
+   dev->sbw = sbw;
+   dev->cr = cr;
+   dev->implicit = implicit;
+   lora_update_timing(dev);
+
+   if (rx) lora_set_mode(dev, mode);
+   lora_batch_end(dev);
+}
+
+/**
+ * Time on air of a packet with the current settings.
+ * @param len Payload length in bytes.
+ * @return Time on air in microseconds.
+ */
+long
+lora_time_on_air_us(lora_dev_t *dev, int len)
+{
+   return lora_airtime_us(dev->sf, dev->sbw, dev->cr, (dev->shadow.modem_config_2 & 0x04) != 0, dev->implicit != 0, dev->preamble, len);
+}
 
-   spi_device_interface_config_t dev = {
-      .clock_speed_hz = 9000000,
+/**
+ * Perform hardware initialization of one radio.
+ * The first call sets up the SPI bus (CONFIG_MISO_GPIO, CONFIG_MOSI_GPIO,
+ * CONFIG_SCK_GPIO); every radio is one more device on it, up to
+ * CONFIG_LORA_RADIO_COUNT.
+ * @param pins Chip select, reset and DIO0 of this radio.
+ * @return Handle of the radio, NULL if none is left or the chip does not answer.
+ */
+lora_dev_t *
+lora_init(const lora_pins_t *pins)
+{
+   static int bus_ready = 0;
+   esp_err_t ret;
+
+   if (_dev_count == CONFIG_LORA_RADIO_COUNT) return NULL;
+   lora_dev_t *dev = &_devs[_dev_count];
+   memset(dev, 0, sizeof(*dev));
+   dev->pins = *pins;
+   dev->mode = -1;
+   dev->preamble = 8;
+   dev->spi_cfg = (spi_device_interface_config_t){
+      .command_bits = 8, // register address
+      .clock_speed_hz = CONFIG_LORA_SPI_CLOCK_KHZ * 1000,
       .mode = 0,
-      .spics_io_num = CONFIG_CS_GPIO,
-      .queue_size = 7,
+      .spics_io_num = pins->cs_gpio,
+      .queue_size = SPI_QUEUE_SIZE,
       .flags = 0,
       .pre_cb = NULL
    };
-   //ret = spi_bus_add_device(VSPI_HOST, &dev, &_spi);
-   ret = spi_bus_add_device(HOST_ID, &dev, &_spi);
+
+   /*
+    * Configure CPU hardware to communicate with the radio chip
+    */
+   gpio_reset_pin(pins->rst_gpio);
+   gpio_set_direction(pins->rst_gpio, GPIO_MODE_OUTPUT);
+   gpio_reset_pin(pins->cs_gpio);
+   gpio_set_direction(pins->cs_gpio, GPIO_MODE_OUTPUT);
+   gpio_set_level(pins->cs_gpio, 1);
+
+   if (!bus_ready) {
+      spi_bus_config_t bus = {
+         .miso_io_num = CONFIG_MISO_GPIO,
+         .mosi_io_num = CONFIG_MOSI_GPIO,
+         .sclk_io_num = CONFIG_SCK_GPIO,
+         .quadwp_io_num = -1,
+         .quadhd_io_num = -1,
+         .max_transfer_sz = 0
+      };
+
+      //ret = spi_bus_initialize(VSPI_HOST, &bus, 0);
+      ret = spi_bus_initialize(HOST_ID, &bus, SPI_DMA_CH_AUTO);
+      assert(ret == ESP_OK);
+      bus_ready = 1;
+   }
+
+   ret = spi_bus_add_device(HOST_ID, &dev->spi_cfg, &dev->spi);
    assert(ret == ESP_OK);
 
    /*
     * Perform hardware reset.
     */
-   lora_reset();
+   lora_reset(dev);
 
    /*
     * Check version.
@@ -571,87 +934,134 @@ lora_init(void)
    uint8_t version;
    uint8_t i = 0;
    while(i++ < TIMEOUT_RESET) {
-      version = lora_read_reg(REG_VERSION);
+      version = lora_read_reg(dev, REG_VERSION);
       ESP_LOGD(TAG, "version=0x%02x", version);
       if(version == 0x12) break;
       vTaskDelay(2);
    }
    ESP_LOGD(TAG, "i=%d, TIMEOUT_RESET=%d", i, TIMEOUT_RESET);
-   if (i == TIMEOUT_RESET + 1) return 0; // Illegal version
-   //assert(i < TIMEOUT_RESET + 1); // at the end of the loop above, the max value i can reach is TIMEOUT_RESET + 1
+   if (i == TIMEOUT_RESET + 1) {
+      // Illegal version
+      spi_bus_remove_device(dev->spi);
+      return NULL;
+   }
+
+   if (pins->dio0_gpio >= 0) {
+      /*
+       * DIO0 interrupt for RxDone/TxDone.
+       */
+      dev->dio0_sem = xSemaphoreCreateBinary();
+      assert(dev->dio0_sem != NULL);
+      gpio_reset_pin(pins->dio0_gpio);
+      gpio_set_direction(pins->dio0_gpio, GPIO_MODE_INPUT);
+      gpio_set_intr_type(pins->dio0_gpio, GPIO_INTR_POSEDGE);
+      ret = gpio_install_isr_service(0);
+      assert(ret == ESP_OK || ret == ESP_ERR_INVALID_STATE); // may already be installed by the application or another radio
+      ret = gpio_isr_handler_add(pins->dio0_gpio, lora_dio0_isr, dev);
+      assert(ret == ESP_OK);
+   }
 
    /*
     * Default configuration.
     */
-   lora_sleep();
-   lora_write_reg(REG_FIFO_RX_BASE_ADDR, 0);
-   lora_write_reg(REG_FIFO_TX_BASE_ADDR, 0);
-   lora_write_reg(REG_LNA, lora_read_reg(REG_LNA) | 0x03);
-   lora_write_reg(REG_MODEM_CONFIG_3, 0x04);
-   lora_set_tx_power(17);
-
-   lora_idle();
-   return 1;
+   lora_sleep(dev);
+   lora_load_shadow(dev);
+   lora_write_reg(dev, REG_FIFO_RX_BASE_ADDR, 0);
+   lora_write_reg(dev, REG_FIFO_TX_BASE_ADDR, 0);
+   lora_write_reg(dev, REG_LNA, lora_read_reg(dev, REG_LNA) | 0x03);
+   lora_write_reg_cached(dev, REG_MODEM_CONFIG_3, &dev->shadow.modem_config_3, (dev->shadow.modem_config_3 & 0x08) | 0x04);
+   lora_set_tx_power(dev, 17);
+
+   lora_idle(dev);
+   _dev_count++;
+   return dev;
+}
+
+/**
+ * Change the SPI clock.
+ * The default is CONFIG_LORA_SPI_CLOCK_KHZ.
+ * The device is removed from the bus and added again, so no transaction
+ * may be in flight (call it before the radio task is started).
+ * The SX127x datasheet specifies up to 10 MHz.
+ * @param hz Requested clock in Hz, rounded down to a divider of the APB clock.
+ * @return Actual clock in Hz, 0 if the device could not be added back.
+ */
+int
+lora_set_spi_clock(lora_dev_t *dev, int hz)
+{
+   int old_hz = dev->spi_cfg.clock_speed_hz;
+   int khz = 0;
+
+   lora_wait_queued(dev);
+   spi_bus_remove_device(dev->spi);
+   dev->spi_cfg.clock_speed_hz = hz;
+   if (spi_bus_add_device(HOST_ID, &dev->spi_cfg, &dev->spi) != ESP_OK) {
+      ESP_LOGE(TAG, "SPI clock %d Hz rejected", hz);
+      dev->spi_cfg.clock_speed_hz = old_hz;
+      if (spi_bus_add_device(HOST_ID, &dev->spi_cfg, &dev->spi) != ESP_OK) return 0;
+   }
+   spi_device_get_actual_freq(dev->spi, &khz);
+   return khz * 1000;
+}
+
+/**
+ * SPI device of the radio, for callers that run their own transactions
+ * (e.g. benchmarks). Not to be used once the radio task is started.
+ */
+struct spi_device_t *
+lora_spi_device(lora_dev_t *dev)
+{
+   return dev->spi;
 }
 
 /**
  * Send a packet.
  * @param buf Data to be sent
  * @param size Size of data.
+ * @return Non-zero if TxDone came, zero on timeout.
  */
-void 
-lora_send_packet(uint8_t *buf, int size)
+int
+lora_send_packet(lora_dev_t *dev, uint8_t *buf, int size)
 {
    /*
     * Transfer data to radio.
+    * Everything up to the TX mode switch is queued back to back and
+    * waited for once.
     */
-   lora_idle();
-   lora_write_reg(REG_FIFO_ADDR_PTR, 0);
+   lora_batch_begin(dev);
+   lora_idle(dev);
+   lora_write_reg(dev, REG_FIFO_ADDR_PTR, 0);
 
-#if BUFFER_IO
-   lora_write_reg_buffer(REG_FIFO, buf, size);
+#if CONFIG_BUFFER_IO
+   lora_write_reg_buffer(dev, REG_FIFO, buf, size);
 #else
    for(int i=0; i<size; i++) 
-      lora_write_reg(REG_FIFO, *buf++);
+      lora_write_reg(dev, REG_FIFO, *buf++);
 #endif
    
-   lora_write_reg(REG_PAYLOAD_LENGTH, size);
+   lora_write_reg(dev, REG_PAYLOAD_LENGTH, size);
    
    /*
     * Start transmission and wait for conclusion.
     */
-   lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
-#if 0
-   while((lora_read_reg(REG_IRQ_FLAGS) & IRQ_TX_DONE_MASK) == 0)
-      vTaskDelay(2);
-#endif
-   int loop = 0;
-   int max_retry;
-   if (_sbw < 2) {
-      max_retry = 500;
-   } else if (_sbw < 4) {
-      max_retry = 250;
-   } else if (_sbw < 6) {
-      max_retry = 125;
-   } else if (_sbw < 8) {
-      max_retry = 60;
+   lora_set_dio_mapping(dev, 0, DIO0_TX_DONE);
+   lora_set_mode(dev, MODE_TX);
+   lora_batch_end(dev);
+   int timeout_ms = lora_time_on_air_us(dev, size) / 1000 + TX_TIMEOUT_MARGIN_MS;
+   ESP_LOGD(TAG, "size=%d timeout_ms=%d", size, timeout_ms);
+   int done = lora_wait_tx_done(dev, timeout_ms);
+   if (done) {
+      dev->mode = MODE_STDBY;
+      dev->stats.tx_ok++;
    } else {
-      max_retry = 30;
-   }
-   ESP_LOGD(TAG, "_sbw=%d max_retry=%d", _sbw, max_retry);
-   while(1) {
-      int irq = lora_read_reg(REG_IRQ_FLAGS);
-      ESP_LOGD(TAG, "lora_read_reg=0x%x", irq);
-      if ((irq & IRQ_TX_DONE_MASK) == IRQ_TX_DONE_MASK) break;
-      loop++;
-      if (loop == max_retry) break;
-      vTaskDelay(2);
-   }
-   if (loop == max_retry) {
-      _send_packet_lost++;
+      dev->stats.tx_timeout++;
       ESP_LOGE(TAG, "lora_send_packet Fail");
    }
-   lora_write_reg(REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+   lora_write_reg(dev, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+
+   // In implicit header mode the same register sets the expected RX length
+   if (dev->implicit && size != dev->implicit) lora_write_reg(dev, REG_PAYLOAD_LENGTH, dev->implicit);
+   return done;
 }
 
 /**
@@ -661,35 +1071,43 @@ lora_send_packet(uint8_t *buf, int size)
  * @return Number of bytes received (zero if no packet available).
  */
 int 
-lora_receive_packet(uint8_t *buf, int size)
+lora_receive_packet(lora_dev_t *dev, uint8_t *buf, int size)
 {
    int len = 0;
 
    /*
     * Check interrupts.
     */
-   int irq = lora_read_reg(REG_IRQ_FLAGS);
-   lora_write_reg(REG_IRQ_FLAGS, irq);
+   int irq = lora_read_reg(dev, REG_IRQ_FLAGS);
+   lora_write_reg(dev, REG_IRQ_FLAGS, irq);
    if((irq & IRQ_RX_DONE_MASK) == 0) return 0;
-   if(irq & IRQ_PAYLOAD_CRC_ERROR_MASK) return 0;
+   if(irq & IRQ_PAYLOAD_CRC_ERROR_MASK) {
+      dev->stats.rx_crc_error++;
+      return 0;
+   }
 
    /*
     * Find packet size.
     */
-   if (_implicit) len = lora_read_reg(REG_PAYLOAD_LENGTH);
-   else len = lora_read_reg(REG_RX_NB_BYTES);
+   if (dev->implicit) len = dev->implicit;
+   else len = lora_read_reg(dev, REG_RX_NB_BYTES);
 
    /*
     * Transfer data from radio.
+    * The FIFO can be read in RX_CONTINUOUS mode, so the radio keeps
+    * listening and a frame right behind this one is not lost.
     */
-   lora_idle();   
-   lora_write_reg(REG_FIFO_ADDR_PTR, lora_read_reg(REG_FIFO_RX_CURRENT_ADDR));
-   if(len > size) len = size;
-#if BUFFER_IO
-   lora_read_reg_buffer(REG_FIFO, buf, len);
+   lora_write_reg(dev, REG_FIFO_ADDR_PTR, lora_read_reg(dev, REG_FIFO_RX_CURRENT_ADDR));
+   if(len > size) {
+      dev->stats.rx_truncated++;
+      len = size;
+   }
+   dev->stats.rx_ok++;
+#if CONFIG_BUFFER_IO
+   lora_read_reg_buffer(dev, REG_FIFO, buf, len);
 #else
    for(int i=0; i<len; i++) 
-      *buf++ = lora_read_reg(REG_FIFO);
+      *buf++ = lora_read_reg(dev, REG_FIFO);
 #endif
 
    return len;
@@ -699,19 +1117,101 @@ lora_receive_packet(uint8_t *buf, int size)
  * Returns non-zero if there is data to read (packet received).
  */
 int
-lora_received(void)
+lora_received(lora_dev_t *dev)
 {
-   if(lora_read_reg(REG_IRQ_FLAGS) & IRQ_RX_DONE_MASK) return 1;
+   if(lora_read_reg(dev, REG_IRQ_FLAGS) & IRQ_RX_DONE_MASK) return 1;
    return 0;
 }
 
+/**
+ * Channel activity detection.
+ * A reception in progress counts as activity and is not interrupted;
+ * otherwise the radio listens for a LoRa preamble for about two symbols
+ * with the current settings and is left in standby.
+ * @return Non-zero if the channel is free.
+ */
+int
+lora_channel_free(lora_dev_t *dev)
+{
+   if (lora_read_reg(dev, REG_MODEM_STAT) & MODEM_STAT_SIGNAL_DETECTED) {
+      dev->stats.cad_busy++;
+      return 0;
+   }
+
+   lora_idle(dev);
+   lora_write_reg(dev, REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   lora_set_dio_mapping(dev, 0, DIO0_CAD_DONE);
+   lora_set_mode(dev, MODE_CAD);
+
+   int timeout_ms = 2 * dev->symbol_us / 1000 + CAD_TIMEOUT_MARGIN_MS;
+   int done = lora_wait_irq_flags(dev, IRQ_CAD_DONE_MASK, timeout_ms);
+   int irq = lora_read_reg(dev, REG_IRQ_FLAGS);
+   lora_write_reg(dev, REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   if (!done) {
+      // Do not hold transmissions back on a stuck CAD
+      ESP_LOGW(TAG, "lora_channel_free CAD timeout");
+      lora_idle(dev);
+      return 1;
+   }
+   dev->mode = MODE_STDBY;
+   if (irq & IRQ_CAD_DETECTED_MASK) {
+      dev->stats.cad_busy++;
+      return 0;
+   }
+   return 1;
+}
+
+/**
+ * Block until a packet is received.
+ * The radio must already be in receive mode (see lora_receive()).
+ * @param timeout_ms Maximum time to wait.
+ * @return Non-zero if a packet is available.
+ */
+int
+lora_wait_rx(lora_dev_t *dev, int timeout_ms)
+{
+   return lora_wait_irq_flags(dev, IRQ_RX_DONE_MASK, timeout_ms);
+}
+
+/**
+ * Block until the current transmission is finished.
+ * @param timeout_ms Maximum time to wait.
+ * @return Non-zero if TxDone was raised.
+ */
+int
+lora_wait_tx_done(lora_dev_t *dev, int timeout_ms)
+{
+   return lora_wait_irq_flags(dev, IRQ_TX_DONE_MASK, timeout_ms);
+}
+
+/**
+ * Block until DIO0 signals an event, lora_wake() is called or the timeout expires.
+ * Without DIO0 this sleeps for a single tick.
+ * @param timeout_ms Maximum time to wait.
+ */
+void
+lora_wait_event(lora_dev_t *dev, int timeout_ms)
+{
+   if (dev->dio0_sem) xSemaphoreTake(dev->dio0_sem, MS_TO_TICKS_CEIL(timeout_ms));
+   else vTaskDelay(1);
+}
+
+/**
+ * Wake up the task blocked in lora_wait_event().
+ */
+void
+lora_wake(lora_dev_t *dev)
+{
+   if (dev->dio0_sem) xSemaphoreGive(dev->dio0_sem);
+}
+
 /**
  * Returns RegIrqFlags.
  */
 int
-lora_get_irq(void)
+lora_get_irq(lora_dev_t *dev)
 {
-   return (lora_read_reg(REG_IRQ_FLAGS));
+   return (lora_read_reg(dev, REG_IRQ_FLAGS));
 }
 
 
@@ -719,18 +1219,38 @@ lora_get_irq(void)
  * Return lost send packet count.
  */
 int 
-lora_packet_lost(void)
+lora_packet_lost(lora_dev_t *dev)
 {
-   return (_send_packet_lost);
+   return (dev->stats.tx_timeout);
+}
+
+/**
+ * Copy the driver counters.
+ * The fields are read one by one while the radio task may update them.
+ * @param stats Counters to fill.
+ */
+void
+lora_get_stats(lora_dev_t *dev, lora_stats_t *stats)
+{
+   *stats = dev->stats;
+}
+
+/**
+ * Reset the driver counters to zero.
+ */
+void
+lora_clear_stats(lora_dev_t *dev)
+{
+   memset(&dev->stats, 0, sizeof(dev->stats));
 }
 
 /**
  * Return last packet's RSSI.
  */
 int 
-lora_packet_rssi(void)
+lora_packet_rssi(lora_dev_t *dev)
 {
-   return (lora_read_reg(REG_PKT_RSSI_VALUE) - (_frequency < 868E6 ? 164 : 157));
+   return (lora_read_reg(dev, REG_PKT_RSSI_VALUE) - (dev->frequency < 868E6 ? 164 : 157));
 }
 
 
@@ -738,35 +1258,43 @@ lora_packet_rssi(void)
  * Return last packet's SNR (signal to noise ratio).
  */
 float 
-lora_packet_snr(void)
+lora_packet_snr(lora_dev_t *dev)
 {
-   return ((int8_t)lora_read_reg(REG_PKT_SNR_VALUE)) * 0.25;
+   return ((int8_t)lora_read_reg(dev, REG_PKT_SNR_VALUE)) * 0.25;
 }
 
 /**
  * Shutdown hardware.
  */
 void 
-lora_close(void)
+lora_close(lora_dev_t *dev)
 {
-   lora_sleep();
+   lora_sleep(dev);
 //   close(__spi);  FIXME: end hardware features after lora_close
 //   close(__cs);
 //   close(__rst);
-//   _spi = -1;
+//   dev->spi = -1;
 //   __cs = -1;
 //   __rst = -1;
 }
 
 void 
-lora_dump_registers(void)
+lora_dump_registers(lora_dev_t *dev)
 {
    int i;
    printf("00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F\n");
    for(i=0; i<0x40; i++) {
-      printf("%02X ", lora_read_reg(i));
+      printf("%02X ", lora_read_reg(dev, i));
       if((i & 0x0f) == 0x0f) printf("\n");
    }
    printf("\n");
 }
 
+void
+lora_dump_stats(lora_dev_t *dev)
+{
+   lora_stats_t st = dev->stats;
+   printf("RX ok %" PRIu32 ", CRC error %" PRIu32 ", truncated %" PRIu32 "\n", st.rx_ok, st.rx_crc_error, st.rx_truncated);
+   printf("TX ok %" PRIu32 ", timeout %" PRIu32 ", CAD busy %" PRIu32 "\n", st.tx_ok, st.tx_timeout, st.cad_busy);
+   printf("SPI %" PRIu32 " transfers, busy %" PRIu64 " us\n", st.spi_transfers, st.spi_busy_us);
+}
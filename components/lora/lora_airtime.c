@@ -0,0 +1,84 @@
+#include <stdint.h>
+
+#include "lora.h"
+
+/*
+ * Airtime math.
+ * Pure functions of the modem settings, without register access, so they
+ * are shared by the driver and by code built for the host (see sim/).
+ */
+
+/*
+ * Signal bandwidth in Hz, by lora_set_bandwidth() index.
+ */
+static const long _bw_hz[10] = {
+   7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000
+};
+
+/**
+ * Bandwidth in Hz
+ * @param sbw Signal bandwidth(0 to 9)
+ * @return Bandwidth in Hz, 0 if sbw is out of range
+ */
+long
+lora_bandwidth_hz(int sbw)
+{
+   return sbw >= 0 && sbw < 10 ? _bw_hz[sbw] : 0;
+}
+
+/**
+ * Symbol time.
+ * @param sf Spreading factor (6 to 12).
+ * @param sbw Signal bandwidth (0 to 9).
+ * @return Symbol time in microseconds.
+ */
+long
+lora_symbol_time_us(int sf, int sbw)
+{
+   return (long)(((int64_t)1000000 << sf) / _bw_hz[sbw]);
+}
+
+/**
+ * Time on air (Semtech SX127x datasheet, 4.1.1.7).
+ * LowDataRateOptimize is assumed on above LORA_LDRO_SYMBOL_US, as the
+ * driver sets it.
+ * @param sf Spreading factor (6 to 12).
+ * @param sbw Signal bandwidth (0 to 9).
+ * @param cr Coding rate (1 to 4).
+ * @param crc Non-zero if the payload CRC is on.
+ * @param implicit Non-zero in implicit header mode.
+ * @param preamble Preamble length in symbols.
+ * @param len Payload length in bytes.
+ * @return Time on air in microseconds.
+ */
+long
+lora_airtime_us(int sf, int sbw, int cr, int crc, int implicit, long preamble, int len)
+{
+   long symbol_us = lora_symbol_time_us(sf, sbw);
+   int ldro = symbol_us > LORA_LDRO_SYMBOL_US;
+   int num = 8 * len - 4 * sf + 28 + 16 * crc - 20 * implicit;
+   int den = 4 * (sf - 2 * ldro);
+   long symbols = 8;
+   if (num > 0) symbols += ((num + den - 1) / den) * (cr + 4);
+
+   // Preamble is (preamble + 4.25) symbols, counted in quarter symbols
+   return ((preamble * 4 + 17) * symbol_us) / 4 + symbols * symbol_us;
+}
+
+/**
+ * Time on air of a packet sent with a given profile.
+ * The preamble is LORA_DEFAULT_PREAMBLE and an out of range bandwidth is
+ * taken as LORA_DEFAULT_BW, which is what every radio runs with unless
+ * lora_set_preamble_length() or lora_set_bandwidth() changed it.
+ * @param profile Profile the packet is sent with.
+ * @param len Payload length in bytes.
+ * @return Time on air in microseconds.
+ */
+long
+lora_profile_time_on_air_us(const lora_profile_t *profile, int len)
+{
+   int sf = profile->sf < 6 ? 6 : profile->sf > 12 ? 12 : profile->sf;
+   int sbw = profile->bw < 0 || profile->bw > 9 ? LORA_DEFAULT_BW : profile->bw;
+   int cr = profile->cr < 1 ? 1 : profile->cr > 4 ? 4 : profile->cr;
+   return lora_airtime_us(sf, sbw, cr, profile->crc != 0, profile->implicit_len != 0, LORA_DEFAULT_PREAMBLE, len);
+}
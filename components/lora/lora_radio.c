@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+
+#include "lora.h"
+#include "lora_radio.h"
+
+/*
+ * Radio task, one per radio.
+ * Owns the radio's SPI device once started: drains received frames into
+ * the RX queue, shared by all radios, and executes the requests (frames to
+ * transmit, profile, role and sleep changes) taken from its own TX queue.
+ * Applications only talk to the radios through these queues.
+ */
+
+#define RADIO_TASK_PRIORITY            10
+#define RADIO_TASK_STACK               (1024 * 3)
+
+// Safety net against a missed DIO0 edge
+#define RADIO_IDLE_TIMEOUT_MS          100
+
+// Listen before talk backoff unit, doubled on every busy try
+#define RADIO_LBT_BACKOFF_MS           10
+
+#define MS_TO_TICKS_CEIL(ms)           (((ms) + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS)
+
+#ifndef CONFIG_RADIO_TASK_CORE
+#define CONFIG_RADIO_TASK_CORE         0
+#endif
+
+#define TAG "LORA_RADIO"
+
+/*
+ * Requests handled by the radio task, in queue order.
+ */
+#define RADIO_OP_SEND                  0
+#define RADIO_OP_PROFILE               1
+#define RADIO_OP_ROLES                 2
+#define RADIO_OP_SLEEP                 3
+
+typedef struct {
+   int op;
+   union {
+      lora_packet_t pkt;         // RADIO_OP_SEND
+      lora_profile_t profile;    // RADIO_OP_PROFILE
+      int roles;                 // RADIO_OP_ROLES
+      int sleep;                 // RADIO_OP_SLEEP
+   };
+} radio_cmd_t;
+
+struct lora_radio {
+   lora_dev_t *dev;
+   int index;
+   int roles;                     // LORA_RADIO_RX and/or LORA_RADIO_TX, radio task only
+   int asleep;                    // Resting in sleep mode, radio task only
+   QueueHandle_t tx_queue;
+   int rx_dropped;
+   SemaphoreHandle_t idle_sem;
+   SemaphoreHandle_t busy_mutex;  // Held by the radio task except while it waits for an event
+   int pending;                   // Requests queued or in progress
+   int64_t last_tx_done_us;       // Written by the radio task, read atomically by others
+};
+
+static lora_radio_t _radios[CONFIG_LORA_RADIO_COUNT];
+static int _radio_count = 0;
+static QueueHandle_t _rx_queue = NULL;
+
+#if CONFIG_RADIO_LBT
+/**
+ * Random listen before talk backoff.
+ * @param tries Busy channel checks so far.
+ * @return Backoff in ticks, at least one.
+ */
+static TickType_t
+lora_radio_backoff(int tries)
+{
+   int window_ms = RADIO_LBT_BACKOFF_MS << (tries - 1);
+   return MS_TO_TICKS_CEIL(1 + esp_random() % window_ms);
+}
+#endif
+
+/**
+ * Move the received packet from the radio FIFO into the RX queue.
+ * @param radio Radio.
+ * @param pkt Scratch descriptor.
+ */
+static void
+lora_radio_drain(lora_radio_t *radio, lora_packet_t *pkt)
+{
+   int len = lora_receive_packet(radio->dev, pkt->payload, LORA_MAX_PAYLOAD);
+   if (len == 0) return; // CRC error
+
+   pkt->len = len;
+   pkt->rssi = lora_packet_rssi(radio->dev);
+   pkt->snr = lora_packet_snr(radio->dev);
+   pkt->timestamp_us = esp_timer_get_time();
+   pkt->radio = radio->index;
+   if (xQueueSend(_rx_queue, pkt, 0) != pdTRUE) {
+      radio->rx_dropped++;
+      ESP_LOGW(TAG, "RX queue full, packet dropped");
+   }
+}
+
+/**
+ * Put the radio back in its resting state: sleep after lora_radio_sleep(),
+ * else receiving, or standby for a transmit-only radio.
+ */
+static void
+lora_radio_rest(lora_radio_t *radio)
+{
+   if (radio->asleep) lora_sleep(radio->dev);
+   else if (radio->roles & LORA_RADIO_RX) lora_receive(radio->dev);
+   else lora_idle(radio->dev);
+}
+
+/**
+ * Wait for a radio event with the radio left to lora_radio_hold().
+ * @param radio Radio.
+ * @param timeout_ms Maximum time to wait.
+ */
+static void
+lora_radio_wait(lora_radio_t *radio, int timeout_ms)
+{
+   xSemaphoreGive(radio->busy_mutex);
+   lora_wait_event(radio->dev, timeout_ms);
+   xSemaphoreTake(radio->busy_mutex, portMAX_DELAY);
+}
+
+static void
+lora_radio_task(void *pvParameters)
+{
+   lora_radio_t *radio = pvParameters;
+   lora_dev_t *dev = radio->dev;
+   lora_packet_t pkt;
+   radio_cmd_t cmd;
+#if CONFIG_RADIO_LBT
+   int lbt_tries = 0;
+   TickType_t lbt_until = 0;
+#endif
+
+   xSemaphoreTake(radio->busy_mutex, portMAX_DELAY);
+   lora_radio_rest(radio);
+   while (1) {
+      /*
+       * Received frames first: TX reuses the FIFO from address 0.
+       */
+      if ((radio->roles & LORA_RADIO_RX) && !radio->asleep && lora_received(dev)) {
+         lora_radio_drain(radio, &pkt);
+         lora_receive(dev);
+         continue;
+      }
+
+      if (xQueuePeek(radio->tx_queue, &cmd, 0) == pdTRUE) {
+#if CONFIG_RADIO_LBT
+         /*
+          * Listen before talk: while the channel is busy, keep receiving
+          * (the activity may well be a frame for us) and retry later.
+          */
+         if (cmd.op == RADIO_OP_SEND) {
+            TickType_t now = xTaskGetTickCount();
+            if ((int)(lbt_until - now) > 0) {
+               lora_radio_wait(radio, pdTICKS_TO_MS(lbt_until - now));
+               continue;
+            }
+            if (lbt_tries < CONFIG_RADIO_LBT_MAX_TRIES && !lora_channel_free(dev)) {
+               lbt_tries++;
+               lbt_until = xTaskGetTickCount() + lora_radio_backoff(lbt_tries);
+               lora_radio_rest(radio);
+               continue;
+            }
+            lbt_tries = 0;
+         }
+#endif
+         xQueueReceive(radio->tx_queue, &cmd, 0);
+         if (cmd.op == RADIO_OP_SEND) {
+            radio->asleep = 0; // A frame to send wakes the radio
+            if (lora_send_packet(dev, cmd.pkt.payload, cmd.pkt.len)) {
+               __atomic_store_n(&radio->last_tx_done_us, esp_timer_get_time(), __ATOMIC_RELEASE);
+            }
+         } else if (cmd.op == RADIO_OP_PROFILE) {
+            lora_apply_profile(dev, &cmd.profile);
+         } else if (cmd.op == RADIO_OP_ROLES) {
+            radio->roles = cmd.roles;
+         } else if (cmd.op == RADIO_OP_SLEEP) {
+            radio->asleep = cmd.sleep;
+         }
+         lora_radio_rest(radio);
+         if (__atomic_sub_fetch(&radio->pending, 1, __ATOMIC_RELEASE) == 0) xSemaphoreGive(radio->idle_sem);
+         continue;
+      }
+
+      lora_radio_wait(radio, RADIO_IDLE_TIMEOUT_MS);
+   }
+}
+
+/**
+ * Create the packet queues and start the task of one radio.
+ * lora_init() and the radio configuration must be done before.
+ * @param dev Radio.
+ * @param roles LORA_RADIO_RX to receive into the shared RX queue (the radio
+ *    rests in RX), LORA_RADIO_TX to transmit (lora_radio_send()). Profile
+ *    changes are taken either way. See also lora_radio_set_roles().
+ * @return Handle for the other lora_radio functions, NULL on failure.
+ */
+lora_radio_t *
+lora_radio_start(lora_dev_t *dev, int roles)
+{
+   char name[configMAX_TASK_NAME_LEN];
+
+   if (_radio_count == CONFIG_LORA_RADIO_COUNT) return NULL;
+   if (_rx_queue == NULL) {
+      _rx_queue = xQueueCreate(CONFIG_RADIO_RX_QUEUE_LEN, sizeof(lora_packet_t));
+      if (_rx_queue == NULL) return NULL;
+   }
+   lora_radio_t *radio = &_radios[_radio_count];
+   radio->dev = dev;
+   radio->index = _radio_count;
+   radio->roles = roles;
+   radio->tx_queue = xQueueCreate(CONFIG_RADIO_TX_QUEUE_LEN, sizeof(radio_cmd_t));
+   radio->idle_sem = xSemaphoreCreateBinary();
+   radio->busy_mutex = xSemaphoreCreateMutex();
+   if (radio->tx_queue == NULL || radio->idle_sem == NULL || radio->busy_mutex == NULL) return NULL;
+
+   snprintf(name, sizeof(name), "LoRa_Radio%d", _radio_count);
+   if (xTaskCreatePinnedToCore(&lora_radio_task, name, RADIO_TASK_STACK, radio,
+                               RADIO_TASK_PRIORITY, NULL, CONFIG_RADIO_TASK_CORE) != pdPASS) return NULL;
+   _radio_count++;
+   return radio;
+}
+
+/**
+ * Hand a request to the radio task.
+ */
+static int
+lora_radio_queue(lora_radio_t *radio, const radio_cmd_t *cmd, int timeout_ms)
+{
+   __atomic_add_fetch(&radio->pending, 1, __ATOMIC_ACQUIRE);
+   if (xQueueSend(radio->tx_queue, cmd, MS_TO_TICKS_CEIL(timeout_ms)) != pdTRUE) {
+      __atomic_sub_fetch(&radio->pending, 1, __ATOMIC_RELEASE);
+      return 0;
+   }
+   lora_wake(radio->dev);
+   return 1;
+}
+
+/**
+ * Queue a packet for transmission.
+ * @param radio Radio started with LORA_RADIO_TX.
+ * @param buf Data to be sent.
+ * @param len Size of data (1 to LORA_MAX_PAYLOAD).
+ * @param timeout_ms Maximum time to wait for room in the TX queue.
+ * @return Non-zero if the packet was queued.
+ */
+int
+lora_radio_send(lora_radio_t *radio, const uint8_t *buf, int len, int timeout_ms)
+{
+   radio_cmd_t cmd;
+
+   if (len <= 0 || len > LORA_MAX_PAYLOAD) return 0;
+   cmd.op = RADIO_OP_SEND;
+   memcpy(cmd.pkt.payload, buf, len);
+   cmd.pkt.len = len;
+   return lora_radio_queue(radio, &cmd, timeout_ms);
+}
+
+/**
+ * Queue a modem profile change.
+ * It is applied in order with the queued packets, see lora_apply_profile().
+ * @param radio Radio.
+ * @param profile Profile to apply.
+ * @param timeout_ms Maximum time to wait for room in the TX queue.
+ * @return Non-zero if the change was queued.
+ */
+int
+lora_radio_set_profile(lora_radio_t *radio, const lora_profile_t *profile, int timeout_ms)
+{
+   radio_cmd_t cmd;
+
+   cmd.op = RADIO_OP_PROFILE;
+   cmd.profile = *profile;
+   return lora_radio_queue(radio, &cmd, timeout_ms);
+}
+
+/**
+ * Queue a role change, e.g. to let a transmitting radio listen on another
+ * channel for a while. It takes effect in order with the queued packets.
+ * @param radio Radio.
+ * @param roles LORA_RADIO_RX and/or LORA_RADIO_TX, see lora_radio_start().
+ * @param timeout_ms Maximum time to wait for room in the TX queue.
+ * @return Non-zero if the change was queued.
+ */
+int
+lora_radio_set_roles(lora_radio_t *radio, int roles, int timeout_ms)
+{
+   radio_cmd_t cmd;
+
+   cmd.op = RADIO_OP_ROLES;
+   cmd.roles = roles;
+   return lora_radio_queue(radio, &cmd, timeout_ms);
+}
+
+/**
+ * Queue a change to or from sleep mode, e.g. between traffic windows.
+ * A sleeping radio neither receives nor keeps its FIFO; it rests in sleep
+ * until woken by another call or by a packet to send. Profile and roles
+ * are kept.
+ * @param radio Radio.
+ * @param sleep Non-zero to sleep, zero to go back to the resting state of
+ *    the roles.
+ * @param timeout_ms Maximum time to wait for room in the TX queue.
+ * @return Non-zero if the change was queued.
+ */
+int
+lora_radio_sleep(lora_radio_t *radio, int sleep, int timeout_ms)
+{
+   radio_cmd_t cmd;
+
+   cmd.op = RADIO_OP_SLEEP;
+   cmd.sleep = sleep;
+   return lora_radio_queue(radio, &cmd, timeout_ms);
+}
+
+/**
+ * Wait until every queued request has been executed by the radio task.
+ * @param radio Radio.
+ * @param timeout_ms Maximum time to wait.
+ * @return esp_timer time of the last TxDone (0 if there was none yet); a
+ *    transmission that timed out leaves it unchanged. -1 on timeout.
+ */
+int64_t
+lora_radio_flush(lora_radio_t *radio, int timeout_ms)
+{
+   TickType_t start = xTaskGetTickCount();
+   TickType_t wait = MS_TO_TICKS_CEIL(timeout_ms);
+
+   while (__atomic_load_n(&radio->pending, __ATOMIC_ACQUIRE) > 0) {
+      TickType_t elapsed = xTaskGetTickCount() - start;
+      if (elapsed >= wait) return -1;
+      xSemaphoreTake(radio->idle_sem, wait - elapsed);
+   }
+   return __atomic_load_n(&radio->last_tx_done_us, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Keep the radio task off the radio, e.g. while the CPU light sleeps.
+ * It only succeeds while the task waits for an event with every request
+ * executed, so no SPI transfer or transmission is cut short. The task
+ * resumes at lora_radio_release().
+ * @param radio Radio.
+ * @return Non-zero if the radio is held.
+ */
+int
+lora_radio_hold(lora_radio_t *radio)
+{
+   if (xSemaphoreTake(radio->busy_mutex, 0) != pdTRUE) return 0;
+   if (__atomic_load_n(&radio->pending, __ATOMIC_ACQUIRE) > 0) {
+      xSemaphoreGive(radio->busy_mutex);
+      return 0;
+   }
+   return 1;
+}
+
+/**
+ * Hand the radio back to its task after lora_radio_hold().
+ * @param radio Radio.
+ */
+void
+lora_radio_release(lora_radio_t *radio)
+{
+   xSemaphoreGive(radio->busy_mutex);
+}
+
+/**
+ * Take the next packet received by any radio.
+ * @param pkt Descriptor to fill; pkt->radio tells which radio got it.
+ * @param timeout_ms Maximum time to wait for a packet.
+ * @return Non-zero if a packet was received.
+ */
+int
+lora_radio_receive(lora_packet_t *pkt, int timeout_ms)
+{
+   if (_rx_queue == NULL) return 0;
+   return xQueueReceive(_rx_queue, pkt, MS_TO_TICKS_CEIL(timeout_ms)) == pdTRUE;
+}
+
+/**
+ * Return the number of received packets dropped because the RX queue was full.
+ */
+int
+lora_radio_dropped(lora_radio_t *radio)
+{
+   return radio->rx_dropped;
+}
+
+/**
+ * Driver handle of a radio, e.g. for lora_dump_stats().
+ */
+lora_dev_t *
+lora_radio_dev(lora_radio_t *radio)
+{
+   return radio->dev;
+}
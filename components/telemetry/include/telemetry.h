@@ -0,0 +1,34 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdint.h>
+
+/*
+ * One sensor reading, 12 bytes.
+ * Values keep the fixed-point encoding of the wire protocol.
+ */
+typedef struct {
+   uint32_t timestamp_ms;  // esp_timer time the frame was received
+   int16_t t;              // 0.01 degree C
+   uint16_t h;             // 0.01 %RH
+   int16_t rssi;           // dBm
+   int8_t snr;             // 0.25 dB
+   uint8_t id;             // Node id
+} telemetry_record_t;
+
+typedef void (*telemetry_alert_handler_t)(void);
+
+void telemetry_init(void);
+int telemetry_push(const telemetry_record_t *rec);
+int telemetry_push_alert(const telemetry_record_t *rec);
+void telemetry_hold_alerts(int hold);
+int telemetry_alerts_held(void);
+void telemetry_set_alert_handler(telemetry_alert_handler_t handler);
+int telemetry_take_alerts(void);
+int telemetry_peek(const telemetry_record_t **batch, int max);
+void telemetry_release(int count);
+int telemetry_count(void);
+int telemetry_wait(int timeout_ms);
+int telemetry_dropped(void);
+
+#endif
@@ -0,0 +1,187 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "telemetry.h"
+
+/*
+ * Telemetry store.
+ * Single producer (the gateway task) and single consumer (the backhaul)
+ * share a statically allocated ring without locks: the producer only
+ * writes _head, the consumer only writes _tail. Indexes run freely and are
+ * masked on access. Nothing here blocks or allocates on the producer side.
+ */
+
+#ifndef CONFIG_TELEMETRY_CAPACITY
+#define CONFIG_TELEMETRY_CAPACITY      256
+#endif
+
+#define CAPACITY                       CONFIG_TELEMETRY_CAPACITY
+#define MASK                           (CAPACITY - 1)
+
+_Static_assert((CAPACITY & MASK) == 0, "CONFIG_TELEMETRY_CAPACITY must be a power of two");
+
+static telemetry_record_t _ring[CAPACITY];
+static uint32_t _head = 0;             // Next record to write
+static uint32_t _tail = 0;             // Next record to read
+static int _dropped = 0;
+static int _alerts = 0;                // Pushed with telemetry_push_alert(), not yet taken
+static telemetry_alert_handler_t _alert_handler = NULL;
+static int _alerts_held = 0;           // telemetry_hold_alerts(), written by the producer only
+static SemaphoreHandle_t _ready_sem = NULL;
+static StaticSemaphore_t _ready_sem_buf;
+
+/**
+ * Set up the consumer wakeup. Must be called before the first record is pushed.
+ */
+void
+telemetry_init(void)
+{
+   _ready_sem = xSemaphoreCreateBinaryStatic(&_ready_sem_buf);
+}
+
+/**
+ * Append a record. Producer side, never blocks.
+ * @param rec Record to copy.
+ * @return Non-zero if stored, zero if the ring was full and the record dropped.
+ */
+int
+telemetry_push(const telemetry_record_t *rec)
+{
+   uint32_t head = _head;
+   uint32_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+   if (head - tail == CAPACITY) {
+      _dropped++;
+      return 0;
+   }
+
+   _ring[head & MASK] = *rec;
+   __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+   if (_ready_sem) xSemaphoreGive(_ready_sem);
+   return 1;
+}
+
+/**
+ * Append a reading that needs attention, e.g. one outside the reporting
+ * thresholds, and call the alert handler so the consumer takes it now
+ * rather than at the end of the cycle. Producer side, never blocks.
+ * @param rec Record to copy.
+ * @return Non-zero if stored, zero if the ring was full and the record dropped.
+ */
+int
+telemetry_push_alert(const telemetry_record_t *rec)
+{
+   if (!telemetry_push(rec)) return 0;
+   __atomic_add_fetch(&_alerts, 1, __ATOMIC_RELEASE);
+   telemetry_alert_handler_t handler = __atomic_load_n(&_alert_handler, __ATOMIC_ACQUIRE);
+   if (handler && !__atomic_load_n(&_alerts_held, __ATOMIC_RELAXED)) handler();
+   return 1;
+}
+
+/**
+ * Hold back the alert handler while the producer must not be disturbed,
+ * e.g. while the consumer could spill to flash during a receive window.
+ * Alerts are still counted; the release calls the handler if any are
+ * waiting. Producer side, see also telemetry_alerts_held().
+ * @param hold Non-zero to hold, zero to release.
+ */
+void
+telemetry_hold_alerts(int hold)
+{
+   __atomic_store_n(&_alerts_held, hold, __ATOMIC_RELEASE);
+   if (hold) return;
+   telemetry_alert_handler_t handler = __atomic_load_n(&_alert_handler, __ATOMIC_ACQUIRE);
+   if (handler && __atomic_load_n(&_alerts, __ATOMIC_ACQUIRE) > 0) handler();
+}
+
+/**
+ * Set the function telemetry_push_alert() calls from the producer, e.g.
+ * to wake the consumer. It must not block.
+ * @param handler Handler, NULL for none.
+ */
+void
+telemetry_set_alert_handler(telemetry_alert_handler_t handler)
+{
+   __atomic_store_n(&_alert_handler, handler, __ATOMIC_RELEASE);
+}
+
+/**
+ * Consumer side: non-zero while telemetry_hold_alerts() holds the alert
+ * handler, so work the consumer would start on its own can wait too.
+ */
+int
+telemetry_alerts_held(void)
+{
+   return __atomic_load_n(&_alerts_held, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Consumer side: number of alerts pushed since the last call.
+ */
+int
+telemetry_take_alerts(void)
+{
+   return __atomic_exchange_n(&_alerts, 0, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Get the oldest records as one contiguous block, without copying.
+ * A batch stops at the end of the ring; the rest comes with the next call.
+ * The records stay valid until telemetry_release().
+ * @param batch Set to the first record.
+ * @param max Maximum number of records wanted.
+ * @return Number of records in the batch, 0 if the ring is empty.
+ */
+int
+telemetry_peek(const telemetry_record_t **batch, int max)
+{
+   uint32_t tail = _tail;
+   uint32_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+   uint32_t count = head - tail;
+   uint32_t to_end = CAPACITY - (tail & MASK);
+
+   if (count > to_end) count = to_end;
+   if (count > (uint32_t)max) count = max;
+   *batch = &_ring[tail & MASK];
+   return count;
+}
+
+/**
+ * Hand consumed records back to the producer.
+ * @param count Records taken from the last telemetry_peek() batch.
+ */
+void
+telemetry_release(int count)
+{
+   __atomic_store_n(&_tail, _tail + count, __ATOMIC_RELEASE);
+}
+
+/**
+ * Number of records waiting.
+ */
+int
+telemetry_count(void)
+{
+   return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Block the consumer until records are waiting.
+ * @param timeout_ms Maximum time to wait.
+ * @return Non-zero if records are waiting.
+ */
+int
+telemetry_wait(int timeout_ms)
+{
+   if (telemetry_count() > 0) return 1;
+   if (_ready_sem) xSemaphoreTake(_ready_sem, pdMS_TO_TICKS(timeout_ms));
+   return telemetry_count() > 0;
+}
+
+/**
+ * Return the number of records dropped because the ring was full.
+ */
+int
+telemetry_dropped(void)
+{
+   return _dropped;
+}
@@ -0,0 +1,85 @@
+/* Adaptive data rate: per-node link quality and uplink setting */
+
+#include <math.h>
+
+#include "sdkconfig.h"
+
+#include "adr.h"
+#include "protocol.h"
+
+#define ADR_MIN_SF 7         // SF6 needs implicit header mode
+#define ADR_MAX_SF 12
+#define ADR_MAX_BW 8         // 250 kHz
+#define ADR_HYSTERESIS_DB 3.0f // Extra margin to move a node to a faster setting
+#define ADR_SMOOTHING 4      // SNR moving average weight, in frames
+
+#ifndef CONFIG_ADR_MARGIN_DB
+#define CONFIG_ADR_MARGIN_DB 10
+#endif
+
+// Demodulation SNR floor per spreading factor (SX127x datasheet)
+static const float snr_floor_db[ADR_MAX_SF + 1] = {
+    [6] = -5.0f, [7] = -7.5f, [8] = -10.0f, [9] = -12.5f, [10] = -15.0f, [11] = -17.5f, [12] = -20.0f,
+};
+
+// Noise bandwidth in dB relative to 125 kHz
+static float bw_offset_db(int bw) {
+    return 10.0f * log10f(lora_bandwidth_hz(bw) / 125000.0f);
+}
+
+// Record the link quality of a frame received from a node on bandwidth bw
+void adr_update(node_info_t *node, const lora_packet_t *pkt, int bw) {
+    float snr = pkt->snr + bw_offset_db(bw);
+    node->rssi = pkt->rssi;
+    if (node->link_samples < ADR_SMOOTHING) node->link_samples++;
+    node->snr += (snr - node->snr) / node->link_samples;
+}
+
+// Pick the uplink setting with the shortest data frame the node's link can
+// hold. Returns 1 if the setting changed.
+int adr_select(node_info_t *node, const lora_profile_t *base) {
+    int sf = base->sf, bw = base->bw;
+#if CONFIG_ADR
+    if (node->link_samples == 0) return 0;
+
+    int cur_sf = node->sf ? node->sf : base->sf;
+    int cur_bw = node->sf ? node->bw : base->bw;
+    lora_profile_t candidate = *base;
+    candidate.sf = cur_sf;
+    candidate.bw = cur_bw;
+    long cur_us = lora_profile_time_on_air_us(&candidate, sizeof(proto_data_t));
+
+    // Slowest fallback when even the current setting has no margin
+    sf = ADR_MAX_SF;
+    bw = base->bw;
+    long best_us = -1;
+    for (int s = ADR_MIN_SF; s <= ADR_MAX_SF; s++) {
+        for (int b = base->bw; b <= ADR_MAX_BW; b++) {
+            candidate.sf = s;
+            candidate.bw = b;
+            long us = lora_profile_time_on_air_us(&candidate, sizeof(proto_data_t));
+            float need = snr_floor_db[s] + bw_offset_db(b) + CONFIG_ADR_MARGIN_DB;
+            if (us < cur_us) need += ADR_HYSTERESIS_DB;
+            if (node->snr < need || (best_us >= 0 && us >= best_us)) continue;
+            best_us = us;
+            sf = s;
+            bw = b;
+        }
+    }
+#endif
+
+    if (sf == base->sf && bw == base->bw) sf = bw = 0;
+    if (sf == node->sf && bw == node->bw) return 0;
+    node->sf = sf;
+    node->bw = bw;
+    return 1;
+}
+
+// Profile of the node's uplink slot
+void adr_profile(const node_info_t *node, const lora_profile_t *base, lora_profile_t *profile) {
+    *profile = *base;
+    if (node->sf) {
+        profile->sf = node->sf;
+        profile->bw = node->bw;
+    }
+}
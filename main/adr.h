@@ -0,0 +1,23 @@
+/* Adaptive data rate
+ *
+ * Each node's uplink slot runs at the fastest spreading factor and
+ * bandwidth its link can hold: the SNR of its frames, smoothed and referred
+ * to 125 kHz, has to clear the demodulation floor of the setting by
+ * CONFIG_ADR_MARGIN_DB. Downlinks, joins and re-polls stay on the base
+ * setting, so a node that missed an update can still be reached.
+ */
+
+#ifndef __ADR_H__
+#define __ADR_H__
+
+#include <stdint.h>
+
+#include "lora.h"
+#include "lora_radio.h"
+#include "node_table.h"
+
+void adr_update(node_info_t *node, const lora_packet_t *pkt, int bw);
+int adr_select(node_info_t *node, const lora_profile_t *base);
+void adr_profile(const node_info_t *node, const lora_profile_t *base, lora_profile_t *profile);
+
+#endif
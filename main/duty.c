@@ -0,0 +1,121 @@
+/* Transmit duty cycle: sliding airtime window and TX admission */
+
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "hal.h"
+#include "stats.h"
+#include "duty.h"
+#include "gateway.h"
+
+#ifndef CONFIG_DUTY_CYCLE_PERMILLE
+#define CONFIG_DUTY_CYCLE_PERMILLE 1000
+#endif
+#ifndef CONFIG_DUTY_CYCLE_WINDOW_S
+#define CONFIG_DUTY_CYCLE_WINDOW_S 3600
+#endif
+
+#define DUTY_WINDOW_US ((int64_t)CONFIG_DUTY_CYCLE_WINDOW_S * 1000000)
+#define DUTY_BUCKET_US (DUTY_WINDOW_US / DUTY_BUCKETS)
+
+static const char *TAG = "Duty";
+
+// Airtime per bucket; a frame counts until its whole bucket has left the
+// window, so the sum errs on the safe side by at most one bucket
+typedef struct {
+    uint32_t bucket_us[DUTY_BUCKETS];
+    int head;             // Current bucket
+    int64_t head_start_us;
+    int64_t used_us;      // Sum of all buckets
+} duty_channel_t;
+
+static duty_channel_t channels[CONFIG_LORA_CHANNELS];
+
+// Expire the buckets that left the window
+static duty_channel_t *channel_at(int channel) {
+    duty_channel_t *ch = &channels[channel];
+    int64_t now = hal_time_us();
+    if (now - ch->head_start_us >= DUTY_WINDOW_US) {
+        memset(ch, 0, sizeof(*ch));
+        ch->head_start_us = now;
+        return ch;
+    }
+    while (now - ch->head_start_us >= DUTY_BUCKET_US) {
+        ch->head = (ch->head + 1) % DUTY_BUCKETS;
+        ch->used_us -= ch->bucket_us[ch->head];
+        ch->bucket_us[ch->head] = 0;
+        ch->head_start_us += DUTY_BUCKET_US;
+    }
+    return ch;
+}
+
+#if CONFIG_DUTY_CYCLE
+// Share of the budget each priority may fill the window up to, in percent
+static const uint8_t prio_share_pct[DUTY_PRIOS] = {
+    [DUTY_PRIO_OPEN] = 50,
+    [DUTY_PRIO_ACCEPT] = 70,
+    [DUTY_PRIO_OK] = 80,
+    [DUTY_PRIO_BEACON] = 90,
+    [DUTY_PRIO_REQUEST] = 100,
+};
+
+// Airtime a priority may fill the window up to
+static int64_t prio_budget_us(int prio) {
+    return duty_budget_us() * prio_share_pct[prio] / 100;
+}
+#endif
+
+// Total airtime allowed per window and channel
+int64_t duty_budget_us(void) {
+    return DUTY_WINDOW_US * CONFIG_DUTY_CYCLE_PERMILLE / 1000;
+}
+
+// Airtime in the window so far
+int64_t duty_used_us(int channel) {
+    return channel_at(channel)->used_us;
+}
+
+// Time until a frame of airtime_us fits the budget of its priority: 0 if it
+// can be sent now, -1 if it never fits. Always 0 without CONFIG_DUTY_CYCLE.
+int64_t duty_wait_us(int channel, long airtime_us, int prio) {
+#if CONFIG_DUTY_CYCLE
+    duty_channel_t *ch = channel_at(channel);
+    int64_t budget_us = prio_budget_us(prio);
+    if (airtime_us > budget_us) return -1;
+
+    int64_t used_us = ch->used_us;
+    if (used_us + airtime_us <= budget_us) return 0;
+    // The oldest bucket leaves the window first
+    for (int k = 1; k < DUTY_BUCKETS; k++) {
+        used_us -= ch->bucket_us[(ch->head + k) % DUTY_BUCKETS];
+        if (used_us + airtime_us <= budget_us) return ch->head_start_us + k * DUTY_BUCKET_US - hal_time_us();
+    }
+    return ch->head_start_us + DUTY_BUCKETS * DUTY_BUCKET_US - hal_time_us();
+#else
+    return 0;
+#endif
+}
+
+void duty_record(int channel, long airtime_us) {
+    duty_channel_t *ch = channel_at(channel);
+    ch->bucket_us[ch->head] += airtime_us;
+    ch->used_us += airtime_us;
+}
+
+// Queue a gateway frame if the budget of its priority allows it and account
+// for its airtime; gateway frames are all sent with gateway_profile.
+// Returns 0 if the frame was dropped or the TX queue full.
+int duty_send(const uint8_t *buf, int len, int prio, int timeout_ms) {
+    long airtime_us = lora_profile_time_on_air_us(&gateway_profile, len);
+    if (duty_wait_us(DUTY_DOWNLINK_CHANNEL, airtime_us, prio) != 0) {
+        ESP_LOGW(TAG, "Frame type %d dropped: %lld of %lld ms airtime used.", buf[0],
+                 (long long)(duty_used_us(DUTY_DOWNLINK_CHANNEL) / 1000), (long long)(duty_budget_us() / 1000));
+        stats_count(STATS_DUTY_DROPPED);
+        return 0;
+    }
+    if (!hal_radio_send(buf, len, timeout_ms)) return 0;
+    duty_record(DUTY_DOWNLINK_CHANNEL, airtime_us);
+    return 1;
+}
@@ -0,0 +1,36 @@
+/* Transmit duty cycle
+ *
+ * Sub-GHz bands cap the share of time a device may transmit, e.g. 1 % per
+ * hour in most of EU868. The airtime of every gateway frame, from the time
+ * on air of the current setting, is accounted per channel over a sliding
+ * window of CONFIG_DUTY_CYCLE_WINDOW_S. Before a frame is queued it is
+ * checked against the budget of its priority: the lower priorities may
+ * only use part of the budget, so as the window fills up, join broadcasts
+ * stop first and data requests last, and the limit itself is never broken.
+ * Without CONFIG_DUTY_CYCLE the airtime is still accounted, for the
+ * statistics, but every frame is admitted.
+ */
+
+#ifndef __DUTY_H__
+#define __DUTY_H__
+
+#include <stdint.h>
+
+// Frame priorities, lowest first
+#define DUTY_PRIO_OPEN 0    // Join window broadcasts
+#define DUTY_PRIO_ACCEPT 1  // Join answers
+#define DUTY_PRIO_OK 2      // Cycle confirmation and other unacknowledged replies
+#define DUTY_PRIO_BEACON 3  // Uplink slots
+#define DUTY_PRIO_REQUEST 4 // Data requests, deferred rather than dropped
+#define DUTY_PRIOS 5
+
+#define DUTY_DOWNLINK_CHANNEL 0 // Every gateway frame, see proto_beacon_t
+#define DUTY_BUCKETS 60         // Window resolution
+
+int64_t duty_wait_us(int channel, long airtime_us, int prio);
+void duty_record(int channel, long airtime_us);
+int64_t duty_used_us(int channel);
+int64_t duty_budget_us(void);
+int duty_send(const uint8_t *buf, int len, int prio, int timeout_ms);
+
+#endif
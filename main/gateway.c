@@ -0,0 +1,707 @@
+/* Gateway cycle: join window, beacon and uplink slots, re-polls, Ok
+ *
+ * Independent of the hardware: the radio and the clock are reached through
+ * hal.h, so the same state machine runs on the ESP32 and in the host
+ * simulator (sim/).
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+
+#include "esp_log.h"
+
+#include "hal.h"
+#include "protocol.h"
+#include "node_table.h"
+#include "reliable.h"
+#include "adr.h"
+#include "stats.h"
+#include "duty.h"
+#include "sched.h"
+#include "telemetry.h"
+#include "gateway.h"
+
+#define BROADCAST_LISTEN_INTERVAL_MS 1000  // Short delay to avoid overloading
+#define JOIN_BACKOFF_MS 700 // Nodes spread their joins over this part of the interval
+#define JOIN_WINDOW_MAX_MS 6000
+#define JOIN_IDLE_INTERVALS 2 // Open intervals without a join that close a quiet window
+#define JOIN_SPLIT_MAX 128 // Id groups the joins are split into at most, a power of two
+#define ONE_DATA_PACKET_SEND_INTERVAL_MS 4000
+#define REPOLL_MAX_MS 8000 // Re-poll phase, at most one interval per node
+#define DATA_DUP_WINDOW_MS REPOLL_MAX_MS // Copies of one re-poll answer arrive within a re-poll phase
+#define ACK_DRAIN_TIMEOUT_MS 2000 // Wait for ACKs before the uplink slots
+#define T_MIN 15.0
+#define T_MAX 30.0
+#define H_MIN 40.0
+#define H_MAX 60.0
+#define TX_QUEUE_TIMEOUT_MS 100
+#define TX_DONE_TIMEOUT_MS 2000
+#define SLOT_GUARD_MS 20   // Clock drift and RX/TX turnaround
+
+#if CONFIG_866MHZ
+#define BASE_FREQUENCY_HZ 866000000L
+#elif CONFIG_915MHZ
+#define BASE_FREQUENCY_HZ 915000000L
+#elif CONFIG_OTHER
+#define BASE_FREQUENCY_HZ (CONFIG_OTHER_FREQUENCY * 1000000L)
+#else
+#define BASE_FREQUENCY_HZ 433000000L
+#endif
+#if CONFIG_LORA_CHANNELS > 1
+#define CHANNEL_SPACING_KHZ CONFIG_LORA_CHANNEL_SPACING_KHZ
+#else
+#define CHANNEL_SPACING_KHZ 0
+#endif
+
+static const char *TAG = "LoRa_Gateway";
+static int warm_start = 0; // Nodes restored from flash, skip the first join window
+static uint8_t cycle = 0;
+static int joins_last_window = 1; // Joins collide under load, so only a quiet window closes early
+static int join_split = 1;        // Id groups taking turns at the Opens, see proto_open_t
+static uint8_t join_group = 0;    // Group of the next Open
+static proto_thresholds_t thresholds = { T_MIN, T_MAX, H_MIN, H_MAX };
+static proto_beacon_segment_t segments[CONFIG_MAX_NODES]; // Slot group lengths of the uplink phase
+
+// Modem settings for every phase of the cycle
+const lora_profile_t gateway_profile = {
+    .frequency = BASE_FREQUENCY_HZ,
+    .sf = 7,
+    .bw = 7,
+    .cr = 1,
+    .crc = 1,
+};
+
+// Carrier frequency of an uplink channel, see proto_beacon_t
+long gateway_channel_hz(int channel) {
+    return BASE_FREQUENCY_HZ + channel * CHANNEL_SPACING_KHZ * 1000L;
+}
+
+static void reset_nodes() {
+    int dropped = node_table_begin_cycle();
+    if (dropped > 0) {
+        ESP_LOGI(TAG, "%d node(s) inactive in the last cycle.", dropped);
+    }
+}
+
+static node_info_t *add_node(uint8_t id, float latitude, float longitude, float t, float d) {
+    int is_new;
+    int already_active = node_table_has(NODE_ACTIVE, id);
+    node_info_t *node = node_table_join(id, &is_new);
+    if (node == NULL) {
+        ESP_LOGW(TAG, "Node list full, cannot add node %d.", id);
+        return NULL;
+    }
+
+    node->latitude = latitude;
+    node->longitude = longitude;
+    node->t = t;
+    node->d = d;
+    node->last_seen = (uint32_t)(hal_time_us() / 1000);
+    if (already_active) {
+        ESP_LOGI(TAG, "Node %d updated. Lat: %.1f, Lon: %.1f, Temp: %.1f, Humidity: %.1f", id, latitude, longitude, t, d);
+    } else {
+        ESP_LOGI(TAG, "Node %d added to the network%s. Lat: %.1f, Lon: %.1f, Temp: %.1f, Humidity: %.1f", id, is_new ? " (new)" : "", latitude, longitude, t, d);
+    }
+    return node;
+}
+
+// Uplink setting of a node as sent in accept and Ok frames
+static proto_rate_t node_rate(const node_info_t *node) {
+    lora_profile_t profile;
+    adr_profile(node, &gateway_profile, &profile);
+    return (proto_rate_t){ profile.sf, profile.bw };
+}
+
+static uint8_t next_seq() {
+    static uint8_t seq = 0;
+    return seq++;
+}
+
+// Retransmit what is due and arm SCHED_RETRANSMIT for the next timer
+static void serve_reliable(void) {
+    int timer_ms = reliable_poll();
+    if (timer_ms < 0) {
+        sched_cancel(SCHED_RETRANSMIT);
+    } else {
+        sched_in_ms(SCHED_RETRANSMIT, timer_ms > 0 ? timer_ms : 1);
+    }
+}
+
+// Receive the next frame that is not an ACK, serving acknowledged delivery
+// (retransmits, ACK matching) meanwhile. Returns 0 as soon as another
+// timer is due; the caller handles it.
+static int receive_frame(lora_packet_t *pkt) {
+    serve_reliable();
+    while (1) {
+        if (sched_due(SCHED_RETRANSMIT)) serve_reliable();
+        int wait_ms = sched_next_ms();
+        if (wait_ms <= 0) return 0;
+        if (!hal_radio_receive(pkt, wait_ms)) continue;
+        int ack = reliable_ack(pkt->payload, pkt->len);
+        serve_reliable();
+        if (!ack) return 1;
+    }
+}
+
+// Serve acknowledged delivery until at most max_pending frames are left,
+// timeout_ms has passed or another timer is due; other frames received
+// meanwhile are dropped
+static void drain_acks(int max_pending, int timeout_ms) {
+    lora_packet_t pkt;
+    sched_in_ms(SCHED_DRAIN, timeout_ms);
+    while (reliable_pending() > max_pending && receive_frame(&pkt)) {
+        ESP_LOGD(TAG, "Frame type %d dropped while waiting for ACKs.", pkt.payload[0]);
+    }
+    sched_cancel(SCHED_DRAIN);
+}
+
+// Queue a frame for acknowledged delivery, waiting for room if needed
+static int send_reliable(uint8_t *frame, int len) {
+    drain_acks(RELIABLE_MAX_OUTSTANDING - 1, ACK_DRAIN_TIMEOUT_MS);
+    int seq = reliable_send(frame, len);
+    serve_reliable();
+    return seq;
+}
+
+// One accept frame for every node that joined in the last Open window
+static void send_accept_packet(const uint8_t *ids, int count) {
+    uint8_t buf[PROTO_MAX_LEN];
+    const proto_thresholds_t th = thresholds;
+    int node_count = node_table_count(NODE_ACTIVE);
+    int len = proto_encode_accept(buf, next_seq(), node_count, &th);
+    for (int i = 0; i < count; i++) {
+        const node_info_t *node = node_table_find(ids[i]);
+        proto_rate_t rate = node_rate(node);
+        len = proto_accept_add(buf, ids[i], node_table_slot(ids[i]), rate);
+        ESP_LOGI(TAG, "Accept: node %d, slot %d at SF%d/BW%d.", ids[i], node_table_slot(ids[i]), rate.sf, rate.bw);
+    }
+
+    if (duty_send(buf, len, DUTY_PRIO_ACCEPT, TX_QUEUE_TIMEOUT_MS)) {
+        ESP_LOGI(TAG, "Sent accept for %d node(s): %d nodes, T %.1f..%.1f, H %.1f..%.1f.", count, node_count, th.t_min, th.t_max, th.h_min, th.h_max);
+    } else {
+        ESP_LOGW(TAG, "Failed to send accept packet.");
+    }
+}
+
+static void send_request_packet(uint8_t id) {
+    uint8_t buf[PROTO_MAX_LEN];
+    int len = proto_encode_hdr(buf, PROTO_REQUEST, id, 0);
+    if (send_reliable(buf, len)) {
+        ESP_LOGI(TAG, "Sent request to node %d.", id);
+    } else {
+        ESP_LOGW(TAG, "Failed to send request packet to node %d.", id);
+    }
+}
+
+// Nodes whose data was stored in the current cycle
+typedef struct {
+    uint8_t id[CONFIG_MAX_NODES];
+    uint8_t repolled[CONFIG_MAX_NODES]; // Missed its slot, answered a request
+    int count;
+} received_t;
+
+static void add_received(received_t *rx, uint8_t id, int repolled) {
+    if (memchr(rx->id, id, rx->count) || rx->count == CONFIG_MAX_NODES) return;
+    rx->id[rx->count] = id;
+    rx->repolled[rx->count] = repolled;
+    rx->count++;
+}
+
+// One Ok frame for the whole cycle: a bit per stored slot, plus the new
+// uplink settings
+static void send_ok_packet(uint8_t cycle, const received_t *rx) {
+    uint8_t buf[PROTO_MAX_LEN];
+    if (rx->count == 0) return;
+
+    int len = proto_encode_ok(buf, cycle, node_table_slot_count());
+    for (int i = 0; i < rx->count; i++) {
+        uint8_t id = rx->id[i];
+        node_info_t *node = node_table_find(id);
+        if (node == NULL) continue;
+        proto_ok_set(buf, node_table_slot(id));
+
+        // A node that missed its slot may have missed its last setting too,
+        // so it is repeated
+        uint8_t sf = node->sf, bw = node->bw;
+        int changed = adr_select(node, &gateway_profile);
+        if (!changed && !rx->repolled[i]) continue;
+
+        int rate_len = proto_ok_add_rate(buf, node_table_slot(id), node_rate(node));
+        if (rate_len == 0) {
+            // No room left, keep the node on its setting until the next cycle
+            node->sf = sf;
+            node->bw = bw;
+            continue;
+        }
+        len = rate_len;
+        if (changed) {
+            ESP_LOGI(TAG, "Node %d: SNR %.1f dB, RSSI %d, uplink now SF%d/BW%d.", id, node->snr, node->rssi, node_rate(node).sf, node_rate(node).bw);
+        }
+    }
+
+    if (duty_send(buf, len, DUTY_PRIO_OK, TX_QUEUE_TIMEOUT_MS)) {
+        ESP_LOGI(TAG, "Sent Ok for %d node(s).", rx->count);
+    } else {
+        ESP_LOGW(TAG, "Failed to send Ok packet.");
+    }
+}
+
+// Setting and channel an uplink slot is received with
+static void slot_profile(int slot, lora_profile_t *profile) {
+    node_info_t *node = node_table_at(slot);
+    if (node == NULL) {
+        *profile = gateway_profile;
+    } else {
+        adr_profile(node, &gateway_profile, profile);
+    }
+    profile->frequency = gateway_channel_hz(slot % CONFIG_LORA_CHANNELS);
+#if CONFIG_IMPLICIT_SLOTS
+    profile->implicit_len = sizeof(proto_data_t);
+#endif
+}
+
+static int same_profile(const lora_profile_t *a, const lora_profile_t *b) {
+    return a->frequency == b->frequency && a->sf == b->sf && a->bw == b->bw && a->implicit_len == b->implicit_len;
+}
+
+// Extra time if two runs of slot groups take the longer length of both
+static long merge_cost(const proto_beacon_segment_t *a, const proto_beacon_segment_t *b) {
+    return a->slot_ms > b->slot_ms ? (long)(a->slot_ms - b->slot_ms) * b->groups : (long)(b->slot_ms - a->slot_ms) * a->groups;
+}
+
+// Lengths of the slot groups: each group lasts its slowest data frame plus
+// the guard, so a node that ADR moved to a slow rate only stretches its own
+// group. Runs of groups of the same length go into seg; while there are
+// more than the beacon can carry, the neighbours that cost the least time
+// together are merged. Returns the number of runs; the last one is the
+// beacon's slot_ms, the others its segments.
+static int slot_segments(int slot_count, int parallel, proto_beacon_segment_t *seg) {
+    int count = 0;
+    for (int first = 0; first < slot_count; first += parallel) {
+        long airtime_us = 0;
+        for (int slot = first; slot < first + parallel && slot < slot_count; slot++) {
+            lora_profile_t profile;
+            slot_profile(slot, &profile);
+            long us = lora_profile_time_on_air_us(&profile, sizeof(proto_data_t));
+            if (us > airtime_us) airtime_us = us;
+        }
+        uint16_t slot_ms = (airtime_us + 999) / 1000 + SLOT_GUARD_MS;
+        if (count > 0 && seg[count - 1].slot_ms == slot_ms) {
+            seg[count - 1].groups++;
+        } else {
+            seg[count].groups = 1;
+            seg[count++].slot_ms = slot_ms;
+        }
+    }
+    while (count > (int)PROTO_BEACON_MAX_SEGMENTS + 1) {
+        int best = 0;
+        for (int i = 1; i + 1 < count; i++) {
+            if (merge_cost(&seg[i], &seg[i + 1]) < merge_cost(&seg[best], &seg[best + 1])) best = i;
+        }
+        if (seg[best + 1].slot_ms > seg[best].slot_ms) seg[best].slot_ms = seg[best + 1].slot_ms;
+        seg[best].groups += seg[best + 1].groups;
+        count--;
+        memmove(&seg[best + 1], &seg[best + 2], (count - best - 1) * sizeof(seg[0]));
+    }
+    return count;
+}
+
+// Validate a data frame and expand a delta frame in place against the
+// node's last stored reading. Returns 0 for other frames and for deltas
+// without a reading to refer to, e.g. after a reboot: these are not
+// acknowledged, so the node falls back to a full frame.
+static int decode_data(lora_packet_t *pkt) {
+    int type = proto_decode(pkt->payload, pkt->len, PROTO_DATA);
+    if (type == PROTO_DATA) return 1;
+    if (type != PROTO_DATA_DELTA) return 0;
+
+    const proto_hdr_t *hdr = proto_hdr(pkt->payload);
+    node_info_t *node = node_table_find(hdr->id);
+    if (node == NULL || !node->has_data) {
+        ESP_LOGW(TAG, "Delta from node %d without a reading to refer to, ignored.", hdr->id);
+        stats_count(STATS_DELTA_REJECTED);
+        return 0;
+    }
+    pkt->len = proto_expand_delta(pkt->payload, node->t_raw, node->h_raw);
+    stats_count(STATS_DELTAS);
+    return 1;
+}
+
+// A copy of the last stored re-poll answer, i.e. the answer to a
+// retransmitted request. Slot frames carry the cycle number and re-poll
+// answers the request's, so only answers are compared, and only with the
+// last stored frame if that was an answer too. Legacy frames have no
+// sequence number and are never copies.
+static int duplicate_data(const node_info_t *node, const proto_data_t *data, int repoll, uint32_t now_ms) {
+    return repoll && node->has_data && data->hdr.seq != 0 && data->hdr.seq == node->data_seq &&
+           now_ms - node->data_ms < DATA_DUP_WINDOW_MS;
+}
+
+// Store a data frame received on bandwidth bw, in a slot or as the answer
+// to a re-poll, returns 1 if it came from a known node. A copy of the last
+// answer counts as received but is not stored or pushed again.
+static int store_data(const lora_packet_t *pkt, int bw, int repoll) {
+    const proto_data_t *data = proto_data(pkt->payload);
+    uint8_t node_id = data->hdr.id;
+    if (node_table_slot(node_id) < 0) {
+        ESP_LOGW(TAG, "Data from unknown node %d ignored.", node_id);
+        return 0;
+    }
+
+    int is_new;
+    node_info_t *node = node_table_join(node_id, &is_new);
+    uint32_t now_ms = (uint32_t)(hal_time_us() / 1000);
+    node->last_seen = now_ms;
+    adr_update(node, pkt, bw);
+    if (duplicate_data(node, data, repoll, now_ms)) {
+        ESP_LOGD(TAG, "Duplicate data from node %d, seq %d.", node_id, data->hdr.seq);
+        stats_count(STATS_DUPLICATES);
+        return 1;
+    }
+    node->t = data->t / PROTO_T_SCALE;
+    node->d = data->h / PROTO_H_SCALE;
+    node->has_data = 1;
+    node->t_raw = data->t;
+    node->h_raw = data->h;
+    node->data_seq = repoll ? data->hdr.seq : 0;
+    node->data_ms = now_ms;
+    node->alert = proto_out_of_range(data, &thresholds);
+
+    telemetry_record_t rec = {
+        .timestamp_ms = pkt->timestamp_us / 1000,
+        .t = data->t,
+        .h = data->h,
+        .rssi = pkt->rssi,
+        .snr = (int8_t)lroundf(pkt->snr * 4),
+        .id = node_id,
+    };
+    if (!(node->alert ? telemetry_push_alert(&rec) : telemetry_push(&rec))) {
+        ESP_LOGW(TAG, "Telemetry buffer full, reading of node %d dropped.", node_id);
+    }
+    if (node->alert) {
+        stats_count(STATS_ALERTS);
+        ESP_LOGW(TAG, "Alert from node %d: Temp=%.1f, Humidity=%.1f", node_id, node->t, node->d);
+    } else {
+        ESP_LOGI(TAG, "Data received from node %d: Temp=%.1f, Humidity=%.1f", node_id, node->t, node->d);
+    }
+    return 1;
+}
+
+#if CONFIG_EXCEPTION_REPORTING
+// Whether the node in a slot has to send in this cycle's beacon, see
+// proto_beacon_exceptions_t. A node whose last frame went unacknowledged
+// may send too, but is not waited for.
+static int report_due(const node_info_t *node, int slot, uint8_t cycle) {
+    return !node->has_data || node->alert || cycle % CONFIG_EXCEPTION_HEARTBEAT_CYCLES == slot % CONFIG_EXCEPTION_HEARTBEAT_CYCLES;
+}
+#endif
+
+// Contention of the last Open interval. Halve the nodes invited to the
+// next Opens when more joins came than one accept frame holds, or when
+// collisions (CRC errors) were at least as many as the joins: a busy
+// channel only shows few of them, as the receiver stays locked on the
+// first frame of overlapping ones. Double them after an interval without
+// collisions that filled at most a quarter of an accept frame. The backoff
+// already fits an accept frame's worth of joins, so a wider one would only
+// make the intervals longer.
+static void adapt_join_split(int joins, int collisions, int full) {
+    if ((full || (collisions > 0 && collisions >= joins)) && join_split < JOIN_SPLIT_MAX) {
+        join_split *= 2;
+    } else if (!full && collisions == 0 && 4 * joins <= (int)PROTO_ACCEPT_MAX && join_split > 1) {
+        join_split /= 2;
+    } else {
+        return;
+    }
+    ESP_LOGI(TAG, "Joins split into %d id group(s).", join_split);
+}
+
+// Join phase: broadcast "Open", collect every join of the interval and
+// give the joined nodes their slots in one accept frame. Under contention
+// the Opens invite one id group at a time, in turn (adapt_join_split()).
+// After a window without any join, the next one closes after
+// JOIN_IDLE_INTERVALS intervals without a join.
+static void join_phase() {
+    uint8_t buf[PROTO_MAX_LEN];
+    uint8_t joined[PROTO_ACCEPT_MAX];
+    int idle = 0, joins = 0;
+    sched_in_ms(SCHED_PHASE, JOIN_WINDOW_MAX_MS);
+    while (!sched_due(SCHED_PHASE) && (joins_last_window > 0 || idle < JOIN_IDLE_INTERVALS)) {
+        // Start one sub assign phase
+        sched_in_ms(SCHED_WINDOW, BROADCAST_LISTEN_INTERVAL_MS);
+
+        // Broadcast message; without airtime left for it, close the window early
+        int send_len = proto_encode_open(buf, next_seq(), JOIN_BACKOFF_MS, join_split, join_group++ % join_split);
+        if (!duty_send(buf, send_len, DUTY_PRIO_OPEN, TX_QUEUE_TIMEOUT_MS)) {
+            ESP_LOGW(TAG, "Open not sent, join window closed.");
+            sched_cancel(SCHED_WINDOW);
+            break;
+        }
+        ESP_LOGI(TAG, "Broadcasted: Open (length: %d bytes)", send_len);
+
+        // Listen for assign packets until the interval ends
+        int joined_count = 0, full = 0;
+        uint32_t rx_errors = hal_radio_rx_errors();
+        lora_packet_t pkt;
+        while (receive_frame(&pkt)) {
+            ESP_LOGI(TAG, "Received %d bytes, RSSI %d", pkt.len, pkt.rssi);
+
+            if (proto_decode(pkt.payload, pkt.len, PROTO_JOIN) == PROTO_JOIN) {
+                const proto_join_t *join = proto_join(pkt.payload);
+                uint8_t node_id = join->hdr.id;
+                if (memchr(joined, node_id, joined_count)) continue;
+                if (joined_count == PROTO_ACCEPT_MAX) {
+                    ESP_LOGW(TAG, "Accept frame full, node %d joins later.", node_id);
+                    full = 1;
+                    continue;
+                }
+
+                float latitude = join->latitude / PROTO_POS_SCALE;
+                float longitude = join->longitude / PROTO_POS_SCALE;
+                float t = -1, d = -1;
+                node_info_t *node = add_node(node_id, latitude, longitude, t, d);
+                if (node == NULL) continue;
+
+                adr_update(node, &pkt, gateway_profile.bw);
+                adr_select(node, &gateway_profile);
+                joined[joined_count++] = node_id;
+                stats_count(STATS_JOINS);
+            }
+        }
+
+        sched_cancel(SCHED_WINDOW);
+        adapt_join_split(joined_count, (int)(hal_radio_rx_errors() - rx_errors), full);
+        if (joined_count > 0) {
+            send_accept_packet(joined, joined_count);
+            joins += joined_count;
+            idle = 0;
+        } else {
+            idle++;
+        }
+    }
+    sched_cancel(SCHED_PHASE);
+    joins_last_window = joins;
+}
+
+// Uplink phase: one beacon, then every known node sends in its own slot.
+// Slots are spread round-robin over the channels; with several receivers,
+// groups of consecutive slots on different channels share the same time.
+static void uplink_phase(uint8_t cycle, received_t *rx) {
+    uint8_t buf[PROTO_MAX_LEN];
+
+    int slot_count = node_table_slot_count();
+    if (slot_count == 0) return;
+    int parallel = hal_radio_receivers();
+    if (parallel > CONFIG_LORA_CHANNELS) parallel = CONFIG_LORA_CHANNELS;
+    if (parallel > slot_count) parallel = slot_count;
+    if (parallel < 1) parallel = 1;
+    int group_count = (slot_count + parallel - 1) / parallel;
+    int seg_count = slot_segments(slot_count, parallel, segments);
+
+    // With exception reporting any node may send, so every slot is listened to
+    int expected = 0;
+    for (int slot = 0; slot < slot_count; slot++) expected += node_table_at(slot) != NULL;
+#if CONFIG_EXCEPTION_REPORTING
+    expected = CONFIG_MAX_NODES + 1;
+#endif
+
+    // No retransmits during the slots, so give pending frames their ACKs first
+    drain_acks(0, ACK_DRAIN_TIMEOUT_MS);
+    sched_cancel(SCHED_RETRANSMIT);
+
+    uint8_t flags = 0;
+#if CONFIG_IMPLICIT_SLOTS
+    flags |= PROTO_BEACON_IMPLICIT;
+#endif
+#if CONFIG_DATA_DELTA
+    flags |= PROTO_BEACON_DELTA;
+#endif
+    int len = proto_encode_beacon(buf, cycle, slot_count, segments[seg_count - 1].slot_ms, flags, CONFIG_LORA_CHANNELS,
+                                  parallel, CHANNEL_SPACING_KHZ);
+#if CONFIG_EXCEPTION_REPORTING
+    len = proto_beacon_add_exceptions(buf, &thresholds, CONFIG_EXCEPTION_HEARTBEAT_CYCLES);
+#endif
+    if (seg_count > 1) len = proto_beacon_add_segments(buf, segments, seg_count - 1);
+    uint32_t slots_ms = proto_beacon_group_ms(buf, group_count);
+    int64_t queued_us = hal_time_us();
+    if (!duty_send(buf, len, DUTY_PRIO_BEACON, TX_QUEUE_TIMEOUT_MS)) {
+        ESP_LOGW(TAG, "Beacon %d not sent, nodes are re-polled.", cycle);
+        return;
+    }
+    // A TxDone from before the beacon means its transmission timed out
+    int64_t slots_start_us = hal_radio_flush(TX_DONE_TIMEOUT_MS);
+    if (slots_start_us < queued_us) {
+        ESP_LOGE(TAG, "Beacon %d not sent.", cycle);
+        return;
+    }
+    ESP_LOGI(TAG, "Beacon %d: %d slots in %u ms, %d slot length(s), on %d channel(s), %d at a time.", cycle, slot_count,
+             (unsigned)slots_ms, seg_count, CONFIG_LORA_CHANNELS, parallel);
+
+    // Listen through all slots, or until every node is in; frames are
+    // timestamped when read from the radio. Receiver k takes slot k of each
+    // group with its node's setting and channel, switched half a guard before
+    // the group opens, when the frames of the previous group have ended.
+    // Receivers other than 0 start off the air.
+    sched_at(SCHED_PHASE, slots_start_us + ((int64_t)slots_ms + SLOT_GUARD_MS) * 1000);
+    sched_at(SCHED_SLOT, slots_start_us);
+    lora_profile_t current[CONFIG_LORA_CHANNELS];
+    for (int k = 0; k < parallel; k++) {
+        current[k] = gateway_profile;
+        if (k > 0) current[k].sf = 0;
+    }
+    int next_group = 0;
+    lora_packet_t pkt;
+    while (rx->count < expected && !sched_due(SCHED_PHASE)) {
+        if (sched_due(SCHED_SLOT)) {
+            for (int k = 0; k < parallel && next_group * parallel + k < slot_count; k++) {
+                lora_profile_t profile;
+                slot_profile(next_group * parallel + k, &profile);
+                if (!same_profile(&profile, &current[k])) {
+                    hal_radio_set_receiver(k, &profile, TX_QUEUE_TIMEOUT_MS);
+                    current[k] = profile;
+                }
+            }
+            if (++next_group < group_count) {
+                sched_at(SCHED_SLOT, slots_start_us + ((int64_t)proto_beacon_group_ms(buf, next_group) - SLOT_GUARD_MS / 2) * 1000);
+            }
+            continue;
+        }
+        int wait_ms = sched_next_ms();
+        if (wait_ms <= 0 || !hal_radio_receive(&pkt, wait_ms)) continue;
+        if (!decode_data(&pkt)) continue;
+
+        const proto_data_t *data = proto_data(pkt.payload);
+        int64_t offset_ms = (pkt.timestamp_us - slots_start_us) / 1000;
+        int group = 0;
+        while (group + 1 < group_count && proto_beacon_group_ms(buf, group + 1) <= offset_ms) group++;
+        int slot = node_table_slot(data->hdr.id);
+        if (slot / parallel != group) {
+            ESP_LOGD(TAG, "Node %d answered in slot group %d.", data->hdr.id, group);
+        }
+        lora_profile_t profile;
+        slot_profile(slot >= 0 ? slot : group * parallel, &profile);
+        if (store_data(&pkt, profile.bw, 0)) add_received(rx, data->hdr.id, 0);
+    }
+    sched_cancel(SCHED_PHASE);
+    sched_cancel(SCHED_SLOT);
+
+#if CONFIG_EXCEPTION_REPORTING
+    // Nodes in range without a heartbeat due were silent by agreement, not missing
+    for (int slot = 0; slot < slot_count; slot++) {
+        node_info_t *node = node_table_at(slot);
+        if (node == NULL || node_table_has(NODE_ACTIVE, node->id) || report_due(node, slot, cycle)) continue;
+        int is_new;
+        node_table_join(node->id, &is_new);
+    }
+#endif
+
+    // Back to the base setting (explicit header) and channel for the downlinks
+    if (parallel > 1 || !same_profile(&current[0], &gateway_profile)) {
+        hal_radio_set_profile(&gateway_profile, TX_QUEUE_TIMEOUT_MS);
+    }
+}
+
+// Request the data of a node that missed its slot, for one interval
+static void repoll_node(received_t *rx, uint8_t node_id) {
+    sched_in_ms(SCHED_WINDOW, ONE_DATA_PACKET_SEND_INTERVAL_MS);
+    lora_packet_t pkt;
+
+    // Send request to node
+    ESP_LOGW(TAG, "Node %d missed its slot.", node_id);
+    stats_count(STATS_MISSED_SLOTS);
+    int64_t request_us = hal_time_us();
+    send_request_packet(node_id);
+
+    // Listen for data packet
+    int data_received = 0;
+    while (receive_frame(&pkt)) {
+        if (decode_data(&pkt) && proto_data(pkt.payload)->hdr.id == node_id) {
+            // The data answers the request even if its ACK was lost
+            reliable_cancel(node_id, PROTO_REQUEST);
+            data_received = store_data(&pkt, gateway_profile.bw, 1);
+            stats_latency(node_id, (int)((pkt.timestamp_us - request_us) / 1000));
+            break;
+        }
+    }
+    sched_cancel(SCHED_WINDOW);
+
+    if (!data_received) {
+        // The window is over, a retransmitted request would go unanswered
+        reliable_cancel(node_id, PROTO_REQUEST);
+        ESP_LOGW(TAG, "No data received from node %d within timeout.", node_id);
+        return;
+    }
+    add_received(rx, node_id, 1);
+    stats_count(STATS_REPOLLS_ANSWERED);
+}
+
+// Re-poll the nodes of the last cycle that missed their slot, one interval
+// each and REPOLL_MAX_MS in total. Nodes whose last reading was an alert
+// go first.
+static void repoll_phase(received_t *rx) {
+    int stale = node_table_count(NODE_STALE);
+    if (stale == 0) return;
+    sched_in_ms(SCHED_PHASE, stale < REPOLL_MAX_MS / ONE_DATA_PACKET_SEND_INTERVAL_MS ? stale * ONE_DATA_PACKET_SEND_INTERVAL_MS : REPOLL_MAX_MS);
+    int over = 0;
+    for (int alerts = 1; alerts >= 0 && !over; alerts--) {
+        for (int id = node_table_next(NODE_STALE, -1); id >= 0; id = node_table_next(NODE_STALE, id)) {
+            const node_info_t *node = node_table_find(id);
+            if ((node != NULL && node->alert) != alerts) continue;
+            if ((over = sched_due(SCHED_PHASE))) break;
+            repoll_node(rx, id);
+        }
+    }
+    sched_cancel(SCHED_PHASE);
+}
+
+// Reporting thresholds, sent with the next accept frame and, for exception
+// reporting, beacon; readings outside them are alerts from now on. The
+// cycle reads them unguarded, so call it from the gateway task only, e.g.
+// between cycles.
+void gateway_set_thresholds(const proto_thresholds_t *th) {
+    thresholds = *th;
+}
+
+// Nodes restored into the node table (see node_table_restore()) are polled
+// in the first cycle without opening a join window
+void gateway_init(int warm) {
+    warm_start = warm;
+    sched_in_ms(SCHED_CYCLE, 0);
+}
+
+// Run one cycle, then arm SCHED_FLUSH for now and SCHED_CYCLE for the next
+// cycle: GATEWAY_CYCLE_MS after this one started, or right away if this one
+// took longer
+void gateway_cycle(void) {
+    static received_t received;
+    int64_t start_us = hal_time_us();
+
+    ESP_LOGI(TAG, "Timeout reached. Resetting node lists.");
+    reset_nodes();
+    received.count = 0;
+
+    // Alerts wake the backhaul after the cycle: with the link down it spills
+    // to flash, which would stall the radio tasks
+    telemetry_hold_alerts(1);
+    if (warm_start) {
+        ESP_LOGI(TAG, "Warm start, beaconing %d restored node(s).", node_table_count(NODE_STALE));
+        warm_start = 0;
+    } else {
+        join_phase();
+    }
+
+    // Ok only after the request phase, so no downlink overlaps an uplink
+    uplink_phase(cycle, &received);
+    repoll_phase(&received);
+    send_ok_packet(cycle++, &received);
+    telemetry_hold_alerts(0);
+    stats_count(STATS_CYCLES);
+
+    int64_t next_us = start_us + GATEWAY_CYCLE_MS * 1000LL;
+    sched_at(SCHED_CYCLE, next_us > hal_time_us() ? next_us : hal_time_us());
+    sched_in_ms(SCHED_FLUSH, 0);
+    // Between cycles the task idles on the cycle timers only, leftovers are
+    // served again with the next frame received
+    sched_cancel(SCHED_RETRANSMIT);
+}
@@ -0,0 +1,36 @@
+/* Gateway cycle
+ *
+ * One cycle opens a join window, beacons the uplink slots of every known
+ * node, re-polls the nodes that missed their slot and confirms the stored
+ * readings with one Ok frame. Readings go to the telemetry ring; those
+ * outside the reporting thresholds (gateway_set_thresholds()) are alerts
+ * and go out through telemetry_push_alert() at the end of the cycle,
+ * before its regular flush. With
+ * CONFIG_EXCEPTION_REPORTING nodes in range only send a heartbeat every
+ * CONFIG_EXCEPTION_HEARTBEAT_CYCLES cycles, see proto_beacon_exceptions_t.
+ *
+ * Every phase ends on its own timer (sched.h) or as soon as it has
+ * nothing left to wait for: the join window once joins stop coming, the
+ * slots once every node is in, the re-polls once every missing node
+ * answered. Cycles start GATEWAY_CYCLE_MS apart, or back to back once the
+ * slots of many nodes need longer; the caller runs them when SCHED_CYCLE
+ * is due and uses the rest of the period for SCHED_FLUSH.
+ */
+
+#ifndef __GATEWAY_H__
+#define __GATEWAY_H__
+
+#include "lora.h"
+#include "protocol.h"
+
+#define GATEWAY_CYCLE_MS 20000
+
+// Modem settings for every phase of the cycle
+extern const lora_profile_t gateway_profile;
+
+long gateway_channel_hz(int channel);
+void gateway_set_thresholds(const proto_thresholds_t *th);
+void gateway_init(int warm);
+void gateway_cycle(void);
+
+#endif
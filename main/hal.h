@@ -0,0 +1,45 @@
+/* Hardware abstraction for the gateway logic
+ *
+ * gateway.c and the modules it uses reach the radio and the clock only
+ * through these functions. hal_esp32.c maps them onto the radio tasks
+ * (lora_radio.h) and esp_timer, and brings the radios up in hal_init();
+ * the host simulator in sim/ implements them over a simulated channel and
+ * is set up by sim_init() instead. Received frames carry their RSSI, SNR
+ * and timestamp in lora_packet_t. Frames lost to a CRC error, e.g. in a
+ * collision, are only counted (hal_radio_rx_errors()).
+ *
+ * Receivers are numbered from 0 to hal_radio_receivers() - 1; receiver 0
+ * always listens, the others are radios that normally only transmit and
+ * listen on their own setting after hal_radio_set_receiver(), until the
+ * next hal_radio_set_profile().
+ *
+ * hal_radio_sleep() puts every radio to sleep, e.g. between cycles; until
+ * hal_radio_wake() nothing is received, a frame to send wakes only the
+ * transmitting radio. hal_idle_until() is where the gateway task waits
+ * with nothing to do and may return early.
+ */
+
+#ifndef __HAL_H__
+#define __HAL_H__
+
+#include <stdint.h>
+
+#include "lora.h"
+#include "lora_radio.h"
+
+int hal_init(const lora_profile_t *profile);
+int hal_radio_send(const uint8_t *buf, int len, int timeout_ms);
+int hal_radio_set_profile(const lora_profile_t *profile, int timeout_ms);
+int hal_radio_receivers(void);
+int hal_radio_set_receiver(int rx, const lora_profile_t *profile, int timeout_ms);
+int64_t hal_radio_flush(int timeout_ms);
+int hal_radio_receive(lora_packet_t *pkt, int timeout_ms);
+uint32_t hal_radio_rx_errors(void);
+void hal_radio_dump_stats(void);
+void hal_radio_clear_stats(void);
+int hal_radio_sleep(int timeout_ms);
+int64_t hal_radio_wake(int timeout_ms);
+void hal_idle_until(int64_t t_us);
+int64_t hal_time_us(void);
+
+#endif
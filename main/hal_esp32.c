@@ -0,0 +1,232 @@
+/* Hardware abstraction: ESP32 with SX127x radios behind radio tasks
+ *
+ * With one radio it receives and transmits. With two
+ * (CONFIG_LORA_RADIO_COUNT) the first stays in receive and the second
+ * transmits, so listen before talk and the TX setup never take the
+ * receiver off the air. Both follow every profile change, so frames are
+ * still received and sent with the same setting. During the uplink slots
+ * the second radio can be made a second receiver on another channel.
+ *
+ * With CONFIG_POWER_SAVE_LIGHT_SLEEP the CPU light sleeps in
+ * hal_idle_until() once the radio tasks are idle, woken by the timer or by
+ * DIO0 of a radio that still listens, so a frame is never left waiting for
+ * the end of the idle time.
+ */
+
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#if CONFIG_POWER_SAVE_LIGHT_SLEEP
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#endif
+
+#include "hal.h"
+
+static const char *TAG = "HAL";
+
+static const lora_pins_t radio_pins[CONFIG_LORA_RADIO_COUNT] = {
+    { CONFIG_CS_GPIO, CONFIG_RST_GPIO, CONFIG_DIO0_GPIO },
+#if CONFIG_LORA_RADIO_COUNT > 1
+    { CONFIG_RADIO2_CS_GPIO, CONFIG_RADIO2_RST_GPIO, CONFIG_RADIO2_DIO0_GPIO },
+#endif
+};
+
+static lora_radio_t *radios[CONFIG_LORA_RADIO_COUNT];
+static int radio_roles[CONFIG_LORA_RADIO_COUNT]; // As started
+static int radio_extra_rx[CONFIG_LORA_RADIO_COUNT]; // Listening since hal_radio_set_receiver()
+static int radio_count = 0;
+static lora_radio_t *tx_radio; // Gateway transmissions
+#if CONFIG_POWER_SAVE_LIGHT_SLEEP
+static int radio_dio0[CONFIG_LORA_RADIO_COUNT]; // By radio, -1 if not wired
+
+#define LIGHT_SLEEP_MIN_US 2000 // Shorter waits are not worth the sleep and wake-up
+#endif
+
+// Bring up the radios with the given profile and assign their roles.
+// A missing second radio leaves the first one doing both.
+int hal_init(const lora_profile_t *profile) {
+    lora_dev_t *devs[CONFIG_LORA_RADIO_COUNT];
+    int count = 0;
+    for (int i = 0; i < CONFIG_LORA_RADIO_COUNT; i++) {
+        devs[count] = lora_init(&radio_pins[i]);
+        if (devs[count] == NULL) {
+            ESP_LOGE(TAG, "LoRa module %d not recognized.", i);
+            continue;
+        }
+#if CONFIG_POWER_SAVE_LIGHT_SLEEP
+        radio_dio0[count] = radio_pins[i].dio0_gpio;
+#endif
+        lora_apply_profile(devs[count++], profile);
+    }
+    if (count == 0) return 0;
+
+    for (int i = 0; i < count; i++) {
+        radio_roles[i] = count == 1 ? LORA_RADIO_RX | LORA_RADIO_TX : i == 0 ? LORA_RADIO_RX : LORA_RADIO_TX;
+        radios[i] = lora_radio_start(devs[i], radio_roles[i]);
+        if (radios[i] == NULL) return 0;
+    }
+    radio_count = count;
+    tx_radio = radios[count - 1];
+    if (count > 1) ESP_LOGI(TAG, "%d radios: radio 0 receives, radio %d transmits.", count, count - 1);
+    return 1;
+}
+
+int hal_radio_send(const uint8_t *buf, int len, int timeout_ms) {
+    return lora_radio_send(tx_radio, buf, len, timeout_ms);
+}
+
+// Applied by every radio, in order with their queued requests. Extra
+// receivers go back to transmitting only.
+int hal_radio_set_profile(const lora_profile_t *profile, int timeout_ms) {
+    int ok = 1;
+    for (int i = 0; i < radio_count; i++) {
+        ok &= lora_radio_set_profile(radios[i], profile, timeout_ms);
+        if (radio_extra_rx[i]) {
+            ok &= lora_radio_set_roles(radios[i], radio_roles[i], timeout_ms);
+            radio_extra_rx[i] = 0;
+        }
+    }
+    return ok;
+}
+
+// Every radio can receive; receiver i is radio i, radio 0 is the receiving one
+int hal_radio_receivers(void) {
+    return radio_count;
+}
+
+int hal_radio_set_receiver(int rx, const lora_profile_t *profile, int timeout_ms) {
+    if (rx < 0 || rx >= radio_count) return 0;
+    int ok = lora_radio_set_profile(radios[rx], profile, timeout_ms);
+    if (!(radio_roles[rx] & LORA_RADIO_RX) && !radio_extra_rx[rx]) {
+        ok &= lora_radio_set_roles(radios[rx], radio_roles[rx] | LORA_RADIO_RX, timeout_ms);
+        radio_extra_rx[rx] = 1;
+    }
+    return ok;
+}
+
+// esp_timer time of the last TxDone, 0 on timeout
+int64_t hal_radio_flush(int timeout_ms) {
+    int64_t end_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    int64_t tx_done_us = 0;
+    for (int i = 0; i < radio_count; i++) {
+        int64_t left_us = end_us - esp_timer_get_time();
+        int64_t done_us = lora_radio_flush(radios[i], left_us > 0 ? (int)((left_us + 999) / 1000) : 0);
+        if (done_us < 0) return 0;
+        if (radios[i] == tx_radio) tx_done_us = done_us;
+    }
+    return tx_done_us;
+}
+
+int hal_radio_receive(lora_packet_t *pkt, int timeout_ms) {
+    return lora_radio_receive(pkt, timeout_ms);
+}
+
+// CRC errors of every radio so far; each counter is written by its radio
+// task only
+uint32_t hal_radio_rx_errors(void) {
+    uint32_t errors = 0;
+    for (int i = 0; i < radio_count; i++) {
+        lora_stats_t stats;
+        lora_get_stats(lora_radio_dev(radios[i]), &stats);
+        errors += stats.rx_crc_error;
+    }
+    return errors;
+}
+
+void hal_radio_dump_stats(void) {
+    for (int i = 0; i < radio_count; i++) {
+        if (radio_count > 1) printf("Radio %d:\n", i);
+        lora_dump_stats(lora_radio_dev(radios[i]));
+        printf("RX queue dropped %d\n", lora_radio_dropped(radios[i]));
+    }
+}
+
+void hal_radio_clear_stats(void) {
+    for (int i = 0; i < radio_count; i++) {
+        lora_clear_stats(lora_radio_dev(radios[i]));
+    }
+}
+
+int hal_radio_sleep(int timeout_ms) {
+    int ok = 1;
+    for (int i = 0; i < radio_count; i++) {
+        ok &= lora_radio_sleep(radios[i], 1, timeout_ms);
+    }
+    return ok;
+}
+
+// esp_timer time the radios are back in their roles, 0 on timeout
+int64_t hal_radio_wake(int timeout_ms) {
+    for (int i = 0; i < radio_count; i++) {
+        if (!lora_radio_sleep(radios[i], 0, timeout_ms)) return 0;
+    }
+    int64_t end_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    for (int i = 0; i < radio_count; i++) {
+        int64_t left_us = end_us - esp_timer_get_time();
+        if (lora_radio_flush(radios[i], left_us > 0 ? (int)((left_us + 999) / 1000) : 0) < 0) return 0;
+    }
+    return esp_timer_get_time();
+}
+
+#if CONFIG_POWER_SAVE_LIGHT_SLEEP
+// Hand the first count radios back to their tasks
+static void release_radios(int count) {
+    for (int i = 0; i < count; i++) lora_radio_release(radios[i]);
+}
+
+// Light sleep for up to sleep_us, 0 if a radio task is still busy or a
+// pending event (DIO0 high) is left to it instead. The radios are held, so
+// the sleep never cuts an SPI transfer or a transmission short. The level
+// wake-up replaces the rising edge interrupt of the pins, so the interrupt
+// is off during the sleep and restored after; the radio tasks are kicked
+// for an edge that went by meanwhile.
+static int light_sleep(int64_t sleep_us) {
+    for (int i = 0; i < radio_count; i++) {
+        if (!lora_radio_hold(radios[i])) {
+            release_radios(i);
+            return 0;
+        }
+    }
+    for (int i = 0; i < radio_count; i++) {
+        if (radio_dio0[i] >= 0 && gpio_get_level(radio_dio0[i])) {
+            release_radios(radio_count);
+            return 0;
+        }
+    }
+    for (int i = 0; i < radio_count; i++) {
+        if (radio_dio0[i] < 0) continue;
+        gpio_intr_disable(radio_dio0[i]);
+        gpio_wakeup_enable(radio_dio0[i], GPIO_INTR_HIGH_LEVEL);
+    }
+    esp_sleep_enable_gpio_wakeup();
+    esp_sleep_enable_timer_wakeup(sleep_us);
+    esp_light_sleep_start();
+    for (int i = 0; i < radio_count; i++) {
+        if (radio_dio0[i] < 0) continue;
+        gpio_wakeup_disable(radio_dio0[i]);
+        gpio_set_intr_type(radio_dio0[i], GPIO_INTR_POSEDGE);
+        gpio_intr_enable(radio_dio0[i]);
+    }
+    release_radios(radio_count);
+    for (int i = 0; i < radio_count; i++) lora_wake(lora_radio_dev(radios[i]));
+    return 1;
+}
+#endif
+
+void hal_idle_until(int64_t t_us) {
+    int64_t left_us = t_us - esp_timer_get_time();
+    if (left_us <= 0) return;
+#if CONFIG_POWER_SAVE_LIGHT_SLEEP
+    if (left_us >= LIGHT_SLEEP_MIN_US && light_sleep(left_us)) return;
+#endif
+    int64_t tick_us = (int64_t)portTICK_PERIOD_MS * 1000;
+    vTaskDelay((left_us + tick_us - 1) / tick_us);
+}
+
+int64_t hal_time_us(void) {
+    return esp_timer_get_time();
+}
@@ -0,0 +1,89 @@
+/* Persistent node registry: one NVS entry per uplink slot */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "node_table.h"
+#include "node_store.h"
+
+#define NODE_STORE_NAMESPACE "nodes"
+#define NODE_STORE_VALID (1u << 24) // Distinguishes node 0 at SF/BW 0 from a free slot
+
+static const char *TAG = "Node_Store";
+
+static nvs_handle_t handle;
+static int opened = 0;
+static uint32_t stored[CONFIG_MAX_NODES]; // Value in flash per slot, 0 if none
+
+// Entry of a slot: id, uplink SF and BW, 0 for a free slot
+static uint32_t slot_entry(int slot) {
+    const node_info_t *node = node_table_at(slot);
+    if (node == NULL) return 0;
+    return NODE_STORE_VALID | (uint32_t)node->bw << 16 | (uint32_t)node->sf << 8 | node->id;
+}
+
+static void slot_key(char *key, int slot) {
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "s%d", slot);
+}
+
+// Restore the nodes saved before the last reboot into the node table.
+// Returns the number of nodes restored.
+int node_store_load(void) {
+    esp_err_t err = nvs_open(NODE_STORE_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot open NVS namespace: %s", esp_err_to_name(err));
+        return 0;
+    }
+    opened = 1;
+
+    int restored = 0;
+    for (int slot = 0; slot < CONFIG_MAX_NODES; slot++) {
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        uint32_t value;
+        slot_key(key, slot);
+        if (nvs_get_u32(handle, key, &value) != ESP_OK || !(value & NODE_STORE_VALID)) continue;
+
+        node_info_t *node = node_table_restore(value & 0xff, slot);
+        if (node == NULL) continue; // Duplicate id, dropped on the next flush
+        node->sf = (value >> 8) & 0xff;
+        node->bw = (value >> 16) & 0xff;
+        stored[slot] = value;
+        restored++;
+    }
+    if (restored > 0) ESP_LOGI(TAG, "%d node(s) restored from flash.", restored);
+    return restored;
+}
+
+// Write the slots that changed since the last flush. Returns the number of
+// slots written, or -1 on error.
+int node_store_flush(void) {
+    if (!opened) return -1;
+
+    int written = 0;
+    for (int slot = 0; slot < CONFIG_MAX_NODES; slot++) {
+        uint32_t value = slot_entry(slot);
+        if (value == stored[slot]) continue;
+
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        slot_key(key, slot);
+        esp_err_t err = value ? nvs_set_u32(handle, key, value) : nvs_erase_key(handle, key);
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGE(TAG, "Cannot save slot %d: %s", slot, esp_err_to_name(err));
+            break;
+        }
+        stored[slot] = value;
+        written++;
+    }
+    if (written == 0) return 0;
+
+    esp_err_t err = nvs_commit(handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "NVS commit failed: %s", esp_err_to_name(err));
+        return -1;
+    }
+    ESP_LOGD(TAG, "%d slot(s) saved.", written);
+    return written;
+}
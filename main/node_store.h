@@ -0,0 +1,16 @@
+/* Persistent node registry
+ *
+ * Node ids, their uplink slots and ADR settings are kept in NVS so that a
+ * rebooted gateway can beacon the known nodes right away instead of
+ * waiting for them to rejoin. Each slot is one 32-bit NVS entry; at the
+ * end of a cycle only the slots that changed are written, with a single
+ * commit.
+ */
+
+#ifndef __NODE_STORE_H__
+#define __NODE_STORE_H__
+
+int node_store_load(void);
+int node_store_flush(void);
+
+#endif
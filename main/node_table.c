@@ -0,0 +1,178 @@
+/* Node registry: id index, slot pool and state bitmaps */
+
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#include "node_table.h"
+
+#define ID_COUNT 256
+#define WORDS (ID_COUNT / 32)
+
+static node_info_t pool[CONFIG_MAX_NODES];
+static uint8_t slot_of[ID_COUNT]; // Pool slot + 1, 0 if the id is unknown
+static uint8_t free_slots[CONFIG_MAX_NODES];
+static int free_count = -1; // Pool is set up on first use
+
+static uint32_t known[WORDS];  // Has a pool slot
+static uint32_t active[WORDS]; // Joined in the current cycle
+static uint32_t prev[WORDS];   // Joined in the previous cycle
+static uint32_t fresh[WORDS];  // NODE_NEW
+static int counts[3];
+
+static inline int bit_get(const uint32_t *set, int id) { return (set[id >> 5] >> (id & 31)) & 1; }
+static inline void bit_set(uint32_t *set, int id) { set[id >> 5] |= 1u << (id & 31); }
+static inline void bit_clear(uint32_t *set, int id) { set[id >> 5] &= ~(1u << (id & 31)); }
+
+static void pool_init() {
+    for (int i = 0; i < CONFIG_MAX_NODES; i++) {
+        free_slots[i] = CONFIG_MAX_NODES - 1 - i;
+    }
+    free_count = CONFIG_MAX_NODES;
+}
+
+// Release the slot of one node that was seen in neither this nor the previous cycle
+static int evict_one() {
+    for (int w = 0; w < WORDS; w++) {
+        uint32_t idle = known[w] & ~active[w] & ~prev[w];
+        if (idle) {
+            int id = (w << 5) + __builtin_ctz(idle);
+            bit_clear(known, id);
+            free_slots[free_count++] = slot_of[id] - 1;
+            slot_of[id] = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const uint32_t *state_set(int state) {
+    switch (state) {
+    case NODE_ACTIVE:
+        return active;
+    case NODE_NEW:
+        return fresh;
+    }
+    return NULL;
+}
+
+// Start a new cycle: nodes of the finished cycle become the reference for churn detection.
+// Returns the number of nodes that were active before the finished cycle but missed it.
+int node_table_begin_cycle() {
+    int dropped = 0;
+    for (int w = 0; w < WORDS; w++) {
+        dropped += __builtin_popcount(prev[w] & ~active[w]);
+    }
+
+    memcpy(prev, active, sizeof(prev));
+    memset(active, 0, sizeof(active));
+    memset(fresh, 0, sizeof(fresh));
+    counts[NODE_STALE] = counts[NODE_ACTIVE];
+    counts[NODE_ACTIVE] = 0;
+    counts[NODE_NEW] = 0;
+    return dropped;
+}
+
+// Look up a known node, NULL if the id has no slot
+node_info_t *node_table_find(uint8_t id) {
+    return slot_of[id] ? &pool[slot_of[id] - 1] : NULL;
+}
+
+// Mark a node active (joined or sent data) in the current cycle, allocating a slot if needed.
+// Returns NULL if the pool is full.
+node_info_t *node_table_join(uint8_t id, int *is_new) {
+    if (free_count < 0) pool_init();
+
+    if (!slot_of[id]) {
+        if (free_count == 0 && !evict_one()) return NULL;
+        int slot = free_slots[--free_count];
+        memset(&pool[slot], 0, sizeof(pool[slot]));
+        pool[slot].id = id;
+        slot_of[id] = slot + 1;
+        bit_set(known, id);
+    }
+
+    *is_new = 0;
+    if (!bit_get(active, id)) {
+        bit_set(active, id);
+        counts[NODE_ACTIVE]++;
+        if (bit_get(prev, id)) {
+            counts[NODE_STALE]--;
+        } else {
+            bit_set(fresh, id);
+            counts[NODE_NEW]++;
+            *is_new = 1;
+        }
+    }
+    return &pool[slot_of[id] - 1];
+}
+
+// Re-register a node in a given slot, e.g. from flash after a reboot, as if
+// it had joined in the current cycle. Returns NULL if the slot is taken.
+node_info_t *node_table_restore(uint8_t id, int slot) {
+    if (free_count < 0) pool_init();
+    if (slot < 0 || slot >= CONFIG_MAX_NODES || slot_of[id]) return NULL;
+
+    int i = 0;
+    while (i < free_count && free_slots[i] != slot) i++;
+    if (i == free_count) return NULL;
+    free_count--;
+    memmove(&free_slots[i], &free_slots[i + 1], free_count - i);
+
+    memset(&pool[slot], 0, sizeof(pool[slot]));
+    pool[slot].id = id;
+    slot_of[id] = slot + 1;
+    bit_set(known, id);
+    bit_set(active, id);
+    counts[NODE_ACTIVE]++;
+    return &pool[slot];
+}
+
+int node_table_count(int state) {
+    return counts[state];
+}
+
+int node_table_has(int state, uint8_t id) {
+    if (state == NODE_STALE) return bit_get(prev, id) && !bit_get(active, id);
+    return bit_get(state_set(state), id);
+}
+
+// Iterate the ids in a state: returns the next id after prev_id (-1 to start), or -1 at the end
+int node_table_next(int state, int prev_id) {
+    for (int id = prev_id + 1; id < ID_COUNT; ) {
+        int w = id >> 5;
+        uint32_t bits;
+        if (state == NODE_STALE) bits = prev[w] & ~active[w];
+        else bits = state_set(state)[w];
+        bits &= ~0u << (id & 31);
+        if (bits) return (w << 5) + __builtin_ctz(bits);
+        id = (w + 1) << 5;
+    }
+    return -1;
+}
+
+// Uplink slot of a known node, -1 if the id is unknown
+int node_table_slot(uint8_t id) {
+    return slot_of[id] - 1;
+}
+
+// Node holding an uplink slot, NULL if the slot is free
+node_info_t *node_table_at(int slot) {
+    if (slot < 0 || slot >= CONFIG_MAX_NODES) return NULL;
+    uint8_t id = pool[slot].id;
+    return slot_of[id] == slot + 1 ? &pool[slot] : NULL;
+}
+
+// Number of uplink slots needed to cover every known node
+int node_table_slot_count() {
+    int used[CONFIG_MAX_NODES] = {0};
+    for (int w = 0; w < WORDS; w++) {
+        for (uint32_t bits = known[w]; bits; bits &= bits - 1) {
+            used[slot_of[(w << 5) + __builtin_ctz(bits)] - 1] = 1;
+        }
+    }
+    for (int slot = CONFIG_MAX_NODES; slot > 0; slot--) {
+        if (used[slot - 1]) return slot;
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* Node registry
+ *
+ * Nodes are keyed by their 8-bit id: a 256-entry index points into a
+ * fixed pool of CONFIG_MAX_NODES slots, and per-cycle state is kept in
+ * 256-bit bitmaps. Lookup, insert and churn detection are O(1).
+ * A node keeps its pool slot while known, which doubles as its uplink
+ * slot index in the cycle.
+ */
+
+#ifndef __NODE_TABLE_H__
+#define __NODE_TABLE_H__
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t id;
+    float latitude;
+    float longitude;
+    float t; // Temperature
+    float d; // Humidity
+    uint32_t last_seen; // ms
+    uint8_t has_data;   // t_raw, h_raw, data_seq and data_ms are set
+    int16_t t_raw;      // Last stored reading as sent, reference of delta frames
+    uint16_t h_raw;
+    uint8_t data_seq;   // Request sequence number if it answered a re-poll, else 0
+    uint32_t data_ms;   // When it was stored
+    uint8_t alert;      // It was outside the reporting thresholds
+    int16_t rssi;       // dBm, last frame
+    float snr;          // dB, smoothed and referred to 125 kHz
+    uint8_t link_samples;
+    uint8_t sf;         // Uplink slot setting, 0 for the gateway's base setting
+    uint8_t bw;
+} node_info_t;
+
+// Node states
+#define NODE_ACTIVE 0 // Joined or sent data in the current cycle
+#define NODE_NEW 1    // Active, but not in the previous cycle
+#define NODE_STALE 2  // Active in the previous cycle, not (yet) in this one
+
+int node_table_begin_cycle(void);
+node_info_t *node_table_find(uint8_t id);
+node_info_t *node_table_join(uint8_t id, int *is_new);
+node_info_t *node_table_restore(uint8_t id, int slot);
+int node_table_count(int state);
+int node_table_has(int state, uint8_t id);
+int node_table_next(int state, int prev_id);
+int node_table_slot(uint8_t id);
+int node_table_slot_count(void);
+node_info_t *node_table_at(int slot);
+
+#endif
@@ -0,0 +1,63 @@
+/* Power save between traffic windows: radio sleep with a measured wake-up lead */
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#include "hal.h"
+#include "sched.h"
+#include "stats.h"
+#include "power.h"
+
+#ifndef CONFIG_POWER_SAVE_MIN_IDLE_MS
+#define CONFIG_POWER_SAVE_MIN_IDLE_MS 100
+#endif
+#ifndef CONFIG_POWER_SAVE_WAKE_LEAD_MS
+#define CONFIG_POWER_SAVE_WAKE_LEAD_MS 5
+#endif
+
+#define POWER_QUEUE_TIMEOUT_MS 100
+#define POWER_WAKE_TIMEOUT_MS 100
+#define POWER_LEAD_MARGIN_US 500 // Over the latency peak
+#define POWER_PEAK_DECAY 8       // The peak moves 1/8 of the way down to each lower sample
+
+static int64_t latency_peak_us = CONFIG_POWER_SAVE_WAKE_LEAD_MS * 1000LL;
+
+// Wake up this early before a deadline
+int64_t power_wake_lead_us(void) {
+    return latency_peak_us + POWER_LEAD_MARGIN_US;
+}
+
+// Follow rises of the latency at once and drops slowly, so one fast
+// wake-up does not make the next one late
+static void track_latency(int64_t latency_us) {
+    if (latency_us > latency_peak_us) latency_peak_us = latency_us;
+    else latency_peak_us -= (latency_peak_us - latency_us) / POWER_PEAK_DECAY;
+}
+
+// Wait for the next deadline of the scheduler, with the radios asleep if it
+// is far enough away
+void power_idle(void) {
+    int64_t next_us = sched_next_deadline();
+    if (next_us == INT64_MAX) {
+        hal_idle_until(hal_time_us() + POWER_QUEUE_TIMEOUT_MS * 1000LL);
+        return;
+    }
+#if CONFIG_POWER_SAVE
+    int64_t lead_us = power_wake_lead_us();
+    int64_t sleep_us = hal_time_us();
+    if (next_us - sleep_us >= CONFIG_POWER_SAVE_MIN_IDLE_MS * 1000LL + lead_us) {
+        int64_t wake_us = next_us - lead_us;
+        // A sleep request that got only part way still needs the wake-up
+        if (hal_radio_sleep(POWER_QUEUE_TIMEOUT_MS)) hal_idle_until(wake_us);
+        int64_t woke_us = hal_time_us(); // Late after an oversleep, early after a radio event
+        int64_t rx_us = hal_radio_wake(POWER_WAKE_TIMEOUT_MS);
+        if (rx_us == 0) return;
+        int64_t latency_us = rx_us - (woke_us < wake_us ? woke_us : wake_us);
+        track_latency(latency_us);
+        stats_wake(rx_us - sleep_us, latency_us, power_wake_lead_us());
+        return;
+    }
+#endif
+    hal_idle_until(next_us);
+}
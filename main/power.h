@@ -0,0 +1,24 @@
+/* Power save between traffic windows
+ *
+ * Between their windows the gateway task has nothing to do until the next
+ * deadline of the scheduler (sched.h), and with slotted nodes nothing is
+ * on air either: nodes only send after an Open, a beacon or a request.
+ * power_idle() waits for that deadline. With CONFIG_POWER_SAVE and a gap
+ * of at least CONFIG_POWER_SAVE_MIN_IDLE_MS the radios sleep meanwhile and
+ * are woken a lead time before it, so they listen again when the deadline
+ * is due. The lead follows the measured wake-to-RX latency, from the
+ * planned wake-up to the radios being back in receive; every wake-up is
+ * reported with stats_wake().
+ *
+ * Everything runs in the gateway task.
+ */
+
+#ifndef __POWER_H__
+#define __POWER_H__
+
+#include <stdint.h>
+
+void power_idle(void);
+int64_t power_wake_lead_us(void);
+
+#endif
@@ -0,0 +1,256 @@
+/* Gateway <-> node wire protocol: encode/decode helpers
+ *
+ * Frames are built and read in place through the packed structs in
+ * protocol.h. Old nodes that still speak the ASCII format can be
+ * translated to binary frames when CONFIG_LEGACY_ASCII is set.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "sdkconfig.h"
+
+#include "protocol.h"
+
+static int ok_bitmap_len(const proto_ok_t *ok) {
+    return (ok->slot_count + 7) / 8;
+}
+
+// Expected frame length, 0 for unknown types
+static int frame_len(const uint8_t *buf, int len) {
+    switch (buf[0]) {
+    case PROTO_OPEN:
+        return sizeof(proto_open_t);
+    case PROTO_REQUEST:
+    case PROTO_ACK:
+        return sizeof(proto_hdr_t);
+    case PROTO_OK:
+        if (len < (int)sizeof(proto_ok_t)) return sizeof(proto_ok_t);
+        return sizeof(proto_ok_t) + ok_bitmap_len((const proto_ok_t *)buf) +
+               ((const proto_ok_t *)buf)->rate_count * sizeof(proto_ok_rate_t);
+    case PROTO_JOIN:
+        return sizeof(proto_join_t);
+    case PROTO_ACCEPT:
+        if (len < (int)sizeof(proto_accept_t)) return sizeof(proto_accept_t);
+        return sizeof(proto_accept_t) + ((const proto_accept_t *)buf)->count * sizeof(proto_accept_entry_t);
+    case PROTO_DATA:
+        return sizeof(proto_data_t);
+    case PROTO_DATA_DELTA:
+        return sizeof(proto_data_delta_t);
+    case PROTO_BEACON: {
+        if (len < (int)sizeof(proto_beacon_t)) return sizeof(proto_beacon_t);
+        if (!(((const proto_beacon_t *)buf)->flags & PROTO_BEACON_SEGMENTS)) {
+            return (const uint8_t *)proto_beacon_segments(buf) - buf;
+        }
+        int need = (const uint8_t *)proto_beacon_segments(buf) - buf + sizeof(proto_beacon_segments_t);
+        if (len < need) return need;
+        return need + proto_beacon_segments(buf)->count * sizeof(proto_beacon_segment_t);
+    }
+    }
+    return 0;
+}
+
+static int32_t to_fixed(float v, float scale) {
+    return (int32_t)lroundf(v * scale);
+}
+
+#if CONFIG_LEGACY_ASCII
+// Translate a legacy ASCII frame of the expected type into its binary form.
+// Legacy frames carry no sequence number, it is reported as 0.
+static int from_ascii(uint8_t *buf, int len, int expect) {
+    char text[PROTO_MAX_LEN + 1];
+    unsigned char id;
+    float a, b;
+
+    if (len > PROTO_MAX_LEN) return 0;
+    memcpy(text, buf, len);
+    text[len] = '\0';
+
+    switch (expect) {
+    case PROTO_JOIN:
+        if (sscanf(text, "%hhu %f %f", &id, &a, &b) != 3) return 0;
+        proto_join_t *join = (proto_join_t *)buf;
+        proto_encode_hdr(buf, PROTO_JOIN, id, 0);
+        join->latitude = to_fixed(a, PROTO_POS_SCALE);
+        join->longitude = to_fixed(b, PROTO_POS_SCALE);
+        return PROTO_JOIN;
+    case PROTO_DATA:
+        if (sscanf(text, "%hhu %f %f", &id, &a, &b) != 3) return 0;
+        proto_data_t *data = (proto_data_t *)buf;
+        proto_encode_hdr(buf, PROTO_DATA, id, 0);
+        data->t = to_fixed(a, PROTO_T_SCALE);
+        data->h = to_fixed(b, PROTO_H_SCALE);
+        return PROTO_DATA;
+    case PROTO_ACK: {
+        int end = 0;
+        if (sscanf(text, "%hhu ACK%n", &id, &end) != 1 || end == 0) return 0;
+        proto_encode_hdr(buf, PROTO_ACK, id, 0);
+        return PROTO_ACK;
+    }
+    }
+    return 0;
+}
+#endif
+
+// Validate a received frame and return its type (0 if invalid).
+// With CONFIG_LEGACY_ASCII, an ASCII frame of the expected type is
+// rewritten in place as a binary frame; buf must hold PROTO_MAX_LEN bytes.
+int proto_decode(uint8_t *buf, int len, int expect) {
+    if (len >= (int)sizeof(proto_hdr_t)) {
+        int need = frame_len(buf, len);
+        if (need && len == need) return buf[0];
+    }
+#if CONFIG_LEGACY_ASCII
+    return from_ascii(buf, len, expect);
+#else
+    (void)expect;
+    return 0;
+#endif
+}
+
+// Rewrite a delta frame validated by proto_decode() in place as the
+// proto_data_t it stands for, given the readings it refers to; buf must
+// hold PROTO_MAX_LEN bytes. Returns the new frame length.
+int proto_expand_delta(uint8_t *buf, int16_t t_ref, uint16_t h_ref) {
+    const proto_data_delta_t *delta = (const proto_data_delta_t *)buf;
+    int16_t t = (int16_t)(t_ref + delta->dt);
+    uint16_t h = (uint16_t)(h_ref + delta->dh);
+    proto_data_t *data = (proto_data_t *)buf;
+    data->hdr.type = PROTO_DATA;
+    data->t = t;
+    data->h = h;
+    return sizeof(proto_data_t);
+}
+
+// Write a frame header, returns the length of a header-only frame
+int proto_encode_hdr(uint8_t *buf, uint8_t type, uint8_t id, uint8_t seq) {
+    proto_hdr_t *hdr = (proto_hdr_t *)buf;
+    hdr->type = type;
+    hdr->id = id;
+    hdr->seq = seq;
+    return sizeof(proto_hdr_t);
+}
+
+int proto_encode_open(uint8_t *buf, uint8_t seq, uint16_t backoff_ms, uint8_t id_split, uint8_t id_group) {
+    proto_open_t *open = (proto_open_t *)buf;
+    proto_encode_hdr(buf, PROTO_OPEN, PROTO_BROADCAST_ID, seq);
+    open->backoff_ms = backoff_ms;
+    open->id_split = id_split ? id_split : 1;
+    open->id_group = id_group % open->id_split;
+    return sizeof(proto_open_t);
+}
+
+// Start an accept frame without entries, see proto_accept_add()
+int proto_encode_accept(uint8_t *buf, uint8_t seq, uint8_t node_count, const proto_thresholds_t *th) {
+    proto_accept_t *accept = (proto_accept_t *)buf;
+    proto_encode_hdr(buf, PROTO_ACCEPT, PROTO_BROADCAST_ID, seq);
+    accept->node_count = node_count;
+    accept->t_min = to_fixed(th->t_min, PROTO_T_SCALE);
+    accept->t_max = to_fixed(th->t_max, PROTO_T_SCALE);
+    accept->h_min = to_fixed(th->h_min, PROTO_H_SCALE);
+    accept->h_max = to_fixed(th->h_max, PROTO_H_SCALE);
+    accept->count = 0;
+    return sizeof(proto_accept_t);
+}
+
+// Append a joined node to an accept frame, returns the new frame length
+// or 0 if the frame is full
+int proto_accept_add(uint8_t *buf, uint8_t id, uint8_t slot, proto_rate_t rate) {
+    proto_accept_t *accept = (proto_accept_t *)buf;
+    if (accept->count == PROTO_ACCEPT_MAX) return 0;
+    proto_accept_entry_t *entry = &accept->entry[accept->count++];
+    entry->id = id;
+    entry->slot = slot;
+    entry->rate = rate;
+    return sizeof(proto_accept_t) + accept->count * sizeof(proto_accept_entry_t);
+}
+
+// Start an Ok frame with every slot cleared and no rate changes.
+// slot_count must leave room for the bitmap in PROTO_MAX_LEN.
+int proto_encode_ok(uint8_t *buf, uint8_t cycle, uint8_t slot_count) {
+    proto_ok_t *ok = (proto_ok_t *)buf;
+    proto_encode_hdr(buf, PROTO_OK, PROTO_BROADCAST_ID, cycle);
+    ok->slot_count = slot_count;
+    ok->rate_count = 0;
+    memset(ok->data, 0, ok_bitmap_len(ok));
+    return sizeof(proto_ok_t) + ok_bitmap_len(ok);
+}
+
+// Mark the data of a slot as stored
+void proto_ok_set(uint8_t *buf, uint8_t slot) {
+    proto_ok_t *ok = (proto_ok_t *)buf;
+    if (slot < ok->slot_count) ok->data[slot >> 3] |= 1 << (slot & 7);
+}
+
+// Append a rate change, returns the new frame length or 0 if the frame is full
+int proto_ok_add_rate(uint8_t *buf, uint8_t slot, proto_rate_t rate) {
+    proto_ok_t *ok = (proto_ok_t *)buf;
+    int len = sizeof(proto_ok_t) + ok_bitmap_len(ok) + ok->rate_count * sizeof(proto_ok_rate_t);
+    if (len + (int)sizeof(proto_ok_rate_t) > PROTO_MAX_LEN) return 0;
+
+    proto_ok_rate_t *change = (proto_ok_rate_t *)&buf[len];
+    change->slot = slot;
+    change->rate = rate;
+    ok->rate_count++;
+    return len + sizeof(proto_ok_rate_t);
+}
+
+int proto_encode_beacon(uint8_t *buf, uint8_t cycle, uint8_t slot_count, uint16_t slot_ms, uint8_t flags,
+                        uint8_t channels, uint8_t parallel, uint16_t spacing_khz) {
+    proto_beacon_t *beacon = (proto_beacon_t *)buf;
+    proto_encode_hdr(buf, PROTO_BEACON, PROTO_BROADCAST_ID, cycle);
+    beacon->slot_count = slot_count;
+    beacon->slot_ms = slot_ms;
+    beacon->flags = flags;
+    beacon->channels = channels;
+    beacon->parallel = parallel;
+    beacon->spacing_khz = spacing_khz;
+    return sizeof(proto_beacon_t);
+}
+
+// Switch a beacon to exception reporting, returns the new frame length
+int proto_beacon_add_exceptions(uint8_t *buf, const proto_thresholds_t *th, uint8_t heartbeat_cycles) {
+    proto_beacon_t *beacon = (proto_beacon_t *)buf;
+    proto_beacon_exceptions_t *exc = (proto_beacon_exceptions_t *)(buf + sizeof(proto_beacon_t));
+    beacon->flags |= PROTO_BEACON_EXCEPTIONS;
+    exc->t_min = to_fixed(th->t_min, PROTO_T_SCALE);
+    exc->t_max = to_fixed(th->t_max, PROTO_T_SCALE);
+    exc->h_min = to_fixed(th->h_min, PROTO_H_SCALE);
+    exc->h_max = to_fixed(th->h_max, PROTO_H_SCALE);
+    exc->heartbeat_cycles = heartbeat_cycles ? heartbeat_cycles : 1;
+    return sizeof(proto_beacon_t) + sizeof(proto_beacon_exceptions_t);
+}
+
+// Give the first slot groups their own lengths, after any exceptions part.
+// Returns the new frame length.
+int proto_beacon_add_segments(uint8_t *buf, const proto_beacon_segment_t *segments, int count) {
+    proto_beacon_t *beacon = (proto_beacon_t *)buf;
+    proto_beacon_segments_t *seg = (proto_beacon_segments_t *)proto_beacon_segments(buf);
+    beacon->flags |= PROTO_BEACON_SEGMENTS;
+    seg->count = count;
+    memcpy(seg->segment, segments, count * sizeof(proto_beacon_segment_t));
+    return (uint8_t *)&seg->segment[count] - buf;
+}
+
+// Start of a slot group in ms after the end of a decoded beacon
+uint32_t proto_beacon_group_ms(const uint8_t *buf, int group) {
+    const proto_beacon_t *beacon = (const proto_beacon_t *)buf;
+    uint32_t ms = 0;
+    if (beacon->flags & PROTO_BEACON_SEGMENTS) {
+        const proto_beacon_segments_t *seg = proto_beacon_segments(buf);
+        for (int i = 0; i < seg->count && group > 0; i++) {
+            int groups = group < seg->segment[i].groups ? group : seg->segment[i].groups;
+            ms += (uint32_t)groups * seg->segment[i].slot_ms;
+            group -= groups;
+        }
+    }
+    return ms + (uint32_t)group * beacon->slot_ms;
+}
+
+// Non-zero if a reading is outside the thresholds, compared in wire units
+// as the nodes do
+int proto_out_of_range(const proto_data_t *data, const proto_thresholds_t *th) {
+    return data->t < to_fixed(th->t_min, PROTO_T_SCALE) || data->t > to_fixed(th->t_max, PROTO_T_SCALE) ||
+           data->h < to_fixed(th->h_min, PROTO_H_SCALE) || data->h > to_fixed(th->h_max, PROTO_H_SCALE);
+}
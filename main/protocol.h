@@ -0,0 +1,204 @@
+/* Gateway <-> node wire protocol
+ *
+ * Every frame starts with a 3-byte header (type, node id, sequence number)
+ * followed by a fixed layout per type. Multi-byte fields are little-endian,
+ * sensor values are fixed-point.
+ */
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdint.h>
+
+// Frame types
+#define PROTO_OPEN 0x01    // Gateway -> all: join window is open, with the join backoff
+#define PROTO_JOIN 0x02    // Node -> gateway: join with position
+#define PROTO_ACCEPT 0x03  // Gateway -> all: joined nodes with slot and uplink rate, thresholds
+#define PROTO_REQUEST 0x04 // Gateway -> node: send data now
+#define PROTO_DATA 0x05    // Node -> gateway: sensor readings
+#define PROTO_OK 0x06      // Gateway -> all: data stored per slot, uplink rate changes
+#define PROTO_ACK 0x07     // Node -> gateway: frame received (seq echoes it)
+#define PROTO_BEACON 0x08  // Gateway -> all: uplink slots start when this frame ends
+#define PROTO_DATA_DELTA 0x09 // Node -> gateway: sensor readings against the last acknowledged ones
+
+#define PROTO_BROADCAST_ID 0xff
+
+// Fixed-point scales
+#define PROTO_POS_SCALE 10000000.0f // 1e-7 degree
+#define PROTO_T_SCALE 100.0f        // 0.01 degree C
+#define PROTO_H_SCALE 100.0f        // 0.01 %RH
+
+#define PROTO_MAX_LEN 64
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t id;
+    uint8_t seq;
+} proto_hdr_t;
+
+// A node that has not joined answers if id % id_split == id_group, after
+// a random delay in [0, backoff_ms), and only once channel activity
+// detection finds the channel free. id_split 1 lets every node answer.
+typedef struct __attribute__((packed)) {
+    proto_hdr_t hdr;
+    uint16_t backoff_ms;
+    uint8_t id_split; // 1 or more
+    uint8_t id_group;
+} proto_open_t;
+
+typedef struct __attribute__((packed)) {
+    proto_hdr_t hdr;
+    int32_t latitude;
+    int32_t longitude;
+} proto_join_t;
+
+// Modem setting for the node's uplink slot; every other frame, both ways,
+// uses the gateway's base setting
+typedef struct __attribute__((packed)) {
+    uint8_t sf; // Spreading factor (6 to 12)
+    uint8_t bw; // Signal bandwidth index, see lora_set_bandwidth()
+} proto_rate_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t id;
+    uint8_t slot; // Uplink slot index, see proto_beacon_t
+    proto_rate_t rate;
+} proto_accept_entry_t;
+
+// Answers every join of one Open window at once. It is not acknowledged:
+// a node that misses it keeps joining and is listed again.
+typedef struct __attribute__((packed)) {
+    proto_hdr_t hdr; // id is PROTO_BROADCAST_ID
+    uint8_t node_count;
+    int16_t t_min;
+    int16_t t_max;
+    uint16_t h_min;
+    uint16_t h_max;
+    uint8_t count;
+    proto_accept_entry_t entry[];
+} proto_accept_t;
+
+#define PROTO_ACCEPT_MAX ((PROTO_MAX_LEN - sizeof(proto_accept_t)) / sizeof(proto_accept_entry_t))
+
+typedef struct __attribute__((packed)) {
+    proto_hdr_t hdr;
+    int16_t t;
+    uint16_t h;
+} proto_data_t;
+
+// Readings as the change since the node's last acknowledged data frame (its
+// bit in an Ok), in the units of proto_data_t. Only sent after a beacon
+// with PROTO_BEACON_DELTA, in explicit header frames, and only if the
+// node's previous data frame was acknowledged. A change that does not fit
+// is sent as proto_data_t.
+typedef struct __attribute__((packed)) {
+    proto_hdr_t hdr;
+    int8_t dt;
+    int8_t dh;
+} proto_data_delta_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t slot;
+    proto_rate_t rate;
+} proto_ok_rate_t;
+
+// Sent once at the end of the cycle's request phase and not acknowledged.
+// data holds one bit per uplink slot, set if the node's data was stored
+// (slot 0 is bit 0 of the first byte), then rate_count proto_ok_rate_t:
+// new uplink settings, applied from the node's next slot.
+typedef struct __attribute__((packed)) {
+    proto_hdr_t hdr; // id is PROTO_BROADCAST_ID, seq is the cycle number
+    uint8_t slot_count;
+    uint8_t rate_count;
+    uint8_t data[];
+} proto_ok_t;
+
+// Beacon flags
+#define PROTO_BEACON_IMPLICIT 0x01 // Slot data frames use implicit header mode
+#define PROTO_BEACON_DELTA 0x02    // proto_data_delta_t is accepted
+#define PROTO_BEACON_EXCEPTIONS 0x04 // Followed by proto_beacon_exceptions_t
+#define PROTO_BEACON_SEGMENTS 0x08   // Followed by proto_beacon_segments_t
+
+// Slot i is sent on channel i % channels, and parallel consecutive slots
+// (on as many channels) form group i / parallel and share the same time.
+// Groups follow each other from the end of the beacon and are slot_ms
+// long, unless PROTO_BEACON_SEGMENTS gives the first ones other lengths
+// (see proto_beacon_group_ms()). Channel c is c * spacing_khz above the
+// base frequency, channel 0, which carries every other frame. The
+// optional parts follow the beacon in the order of their flags.
+typedef struct __attribute__((packed)) {
+    proto_hdr_t hdr; // seq is the cycle number
+    uint8_t slot_count;
+    uint16_t slot_ms;
+    uint8_t flags;
+    uint8_t channels;     // 1 to 8
+    uint8_t parallel;     // 1 to channels
+    uint16_t spacing_khz;
+} proto_beacon_t;
+
+// Exception reporting: a node sends in its slot only while a reading is
+// outside the thresholds, once more when it is back in range, while its
+// last data frame is not acknowledged, and every heartbeat_cycles cycles,
+// in the cycles where cycle % heartbeat_cycles equals slot %
+// heartbeat_cycles. The thresholds apply from this beacon on.
+typedef struct __attribute__((packed)) {
+    int16_t t_min;
+    int16_t t_max;
+    uint16_t h_min;
+    uint16_t h_max;
+    uint8_t heartbeat_cycles; // 1 or more
+} proto_beacon_exceptions_t;
+
+// Slot lengths by rate: the first groups come in segments of groups
+// consecutive groups that last slot_ms each, the groups after the last
+// segment last the beacon's slot_ms
+typedef struct __attribute__((packed)) {
+    uint8_t groups;
+    uint16_t slot_ms;
+} proto_beacon_segment_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t count;
+    proto_beacon_segment_t segment[];
+} proto_beacon_segments_t;
+
+#define PROTO_BEACON_MAX_SEGMENTS \
+    ((PROTO_MAX_LEN - sizeof(proto_beacon_t) - sizeof(proto_beacon_exceptions_t) - sizeof(proto_beacon_segments_t)) / sizeof(proto_beacon_segment_t))
+
+// Reporting thresholds carried by the accept frame
+typedef struct {
+    float t_min;
+    float t_max;
+    float h_min;
+    float h_max;
+} proto_thresholds_t;
+
+int proto_decode(uint8_t *buf, int len, int expect);
+int proto_encode_hdr(uint8_t *buf, uint8_t type, uint8_t id, uint8_t seq);
+int proto_encode_open(uint8_t *buf, uint8_t seq, uint16_t backoff_ms, uint8_t id_split, uint8_t id_group);
+int proto_encode_accept(uint8_t *buf, uint8_t seq, uint8_t node_count, const proto_thresholds_t *th);
+int proto_accept_add(uint8_t *buf, uint8_t id, uint8_t slot, proto_rate_t rate);
+int proto_encode_ok(uint8_t *buf, uint8_t cycle, uint8_t slot_count);
+int proto_expand_delta(uint8_t *buf, int16_t t_ref, uint16_t h_ref);
+void proto_ok_set(uint8_t *buf, uint8_t slot);
+int proto_ok_add_rate(uint8_t *buf, uint8_t slot, proto_rate_t rate);
+int proto_encode_beacon(uint8_t *buf, uint8_t cycle, uint8_t slot_count, uint16_t slot_ms, uint8_t flags,
+                        uint8_t channels, uint8_t parallel, uint16_t spacing_khz);
+int proto_beacon_add_exceptions(uint8_t *buf, const proto_thresholds_t *th, uint8_t heartbeat_cycles);
+int proto_beacon_add_segments(uint8_t *buf, const proto_beacon_segment_t *segments, int count);
+uint32_t proto_beacon_group_ms(const uint8_t *buf, int group);
+int proto_out_of_range(const proto_data_t *data, const proto_thresholds_t *th);
+
+// Zero-copy access to a frame validated by proto_decode()
+static inline const proto_hdr_t *proto_hdr(const uint8_t *buf) { return (const proto_hdr_t *)buf; }
+static inline const proto_join_t *proto_join(const uint8_t *buf) { return (const proto_join_t *)buf; }
+static inline const proto_data_t *proto_data(const uint8_t *buf) { return (const proto_data_t *)buf; }
+static inline const proto_beacon_exceptions_t *proto_beacon_exceptions(const uint8_t *buf) {
+    return (const proto_beacon_exceptions_t *)(buf + sizeof(proto_beacon_t));
+}
+static inline const proto_beacon_segments_t *proto_beacon_segments(const uint8_t *buf) {
+    int exc = ((const proto_beacon_t *)buf)->flags & PROTO_BEACON_EXCEPTIONS ? sizeof(proto_beacon_exceptions_t) : 0;
+    return (const proto_beacon_segments_t *)(buf + sizeof(proto_beacon_t) + exc);
+}
+
+#endif
@@ -0,0 +1,217 @@
+/* Reliable delivery of gateway -> node frames
+ *
+ * Sequence numbers run per node and skip 0, which is what a legacy ASCII
+ * ACK decodes to; such an ACK is matched against the oldest frame sent to
+ * that node. Frames are data requests: when the duty cycle budget is
+ * used up they wait for airtime instead of being dropped.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "hal.h"
+#include "protocol.h"
+#include "reliable.h"
+#include "stats.h"
+#include "duty.h"
+#include "gateway.h"
+
+#define RELIABLE_TURNAROUND_MS 50 // Node RX-to-TX switch and processing
+#define RELIABLE_MAX_BACKOFF_MS 4000
+#define RELIABLE_TX_QUEUE_TIMEOUT_MS 100
+#define RELIABLE_TX_DONE_TIMEOUT_MS 2000 // Frames queued ahead, listen before talk and the frame itself
+#define RELIABLE_TX_DONE_POLL_MS 5 // While the TxDone is late
+
+static const char *TAG = "Reliable";
+
+typedef struct {
+    uint8_t frame[PROTO_MAX_LEN];
+    uint8_t len;
+    uint8_t tries;       // Transmissions so far, 0 while never sent
+    int64_t due_us;      // Earliest (re)transmit time
+    int64_t sent_us;     // Handed to the radio, last try
+    int64_t deadline_us; // End of the ACK window after TxDone, 0 until TxDone
+} outstanding_t;
+
+static outstanding_t _table[RELIABLE_MAX_OUTSTANDING];
+static int _count = 0;
+static int _in_flight = -1; // Entry waiting for its ACK, -1 if none
+static uint8_t _seq[256];   // Last sequence number per node
+
+// Requests and ACKs both use the gateway's base setting
+static long airtime_us(int len) {
+    return lora_profile_time_on_air_us(&gateway_profile, len);
+}
+
+// From TxDone: the node's turnaround plus the ACK's time on air
+static int ack_window_ms(void) {
+    return (int)((airtime_us(sizeof(proto_hdr_t)) + 999) / 1000) + RELIABLE_TURNAROUND_MS;
+}
+
+// A whole exchange: the frame's time on air plus the ACK window
+static int exchange_ms(int len) {
+    return (int)((airtime_us(len) + 999) / 1000) + ack_window_ms();
+}
+
+static const proto_hdr_t *entry_hdr(int i) {
+    return proto_hdr(_table[i].frame);
+}
+
+// Entries stay in send order, oldest first
+static void remove_entry(int i) {
+    _count--;
+    memmove(&_table[i], &_table[i + 1], (_count - i) * sizeof(_table[0]));
+    if (_in_flight == i) {
+        _in_flight = -1;
+    } else if (_in_flight > i) {
+        _in_flight--;
+    }
+}
+
+// Queue a frame for acknowledged delivery; its sequence number is filled
+// in here. Returns 0 if the table is full, otherwise the sequence number.
+int reliable_send(uint8_t *frame, int len) {
+    if (_count == RELIABLE_MAX_OUTSTANDING || len > PROTO_MAX_LEN) return 0;
+
+    proto_hdr_t *hdr = (proto_hdr_t *)frame;
+    if (++_seq[hdr->id] == 0) _seq[hdr->id] = 1;
+    hdr->seq = _seq[hdr->id];
+
+    outstanding_t *e = &_table[_count++];
+    memcpy(e->frame, frame, len);
+    e->len = len;
+    e->tries = 0;
+    e->due_us = 0;
+    e->deadline_us = 0;
+    reliable_poll();
+    return hdr->seq;
+}
+
+// Feed a received frame; returns 1 if it was an ACK (matched or not) and
+// needs no further handling
+int reliable_ack(uint8_t *buf, int len) {
+    if (proto_decode(buf, len, PROTO_ACK) != PROTO_ACK) return 0;
+
+    const proto_hdr_t *ack = proto_hdr(buf);
+    int match = -1;
+    for (int i = 0; i < _count; i++) {
+        const proto_hdr_t *hdr = entry_hdr(i);
+        if (hdr->id != ack->id) continue;
+        if (hdr->seq == ack->seq) {
+            match = i;
+            break;
+        }
+        // Legacy: oldest frame to this node, i.e. the lowest index
+        if (ack->seq == 0 && match < 0) match = i;
+    }
+
+    if (match < 0) {
+        ESP_LOGD(TAG, "Stray ACK from node %d, seq %d.", ack->id, ack->seq);
+        return 1;
+    }
+    ESP_LOGI(TAG, "ACK from node %d for frame type %d (try %d).", ack->id, entry_hdr(match)->type, _table[match].tries);
+    remove_entry(match);
+    reliable_poll();
+    return 1;
+}
+
+// Retransmit timed out frames and start the next one once the channel is
+// free. Returns the ms until the next timer expires, or -1 if idle.
+int reliable_poll(void) {
+    int64_t now = hal_time_us();
+
+    // Frames queued ahead and listen before talk delay the frame by an
+    // unknown time, so the ACK window opens at its TxDone
+    if (_in_flight >= 0 && _table[_in_flight].deadline_us == 0) {
+        outstanding_t *e = &_table[_in_flight];
+        int64_t tx_done_us = hal_radio_flush(0);
+        if (tx_done_us >= e->sent_us) {
+            e->deadline_us = tx_done_us + (int64_t)ack_window_ms() * 1000;
+        } else if (now - e->sent_us >= (int64_t)RELIABLE_TX_DONE_TIMEOUT_MS * 1000) {
+            ESP_LOGW(TAG, "No TxDone for frame type %d to node %d.", e->frame[0], e->frame[1]);
+            e->deadline_us = now; // Retried like a frame without ACK
+        }
+    }
+
+    if (_in_flight >= 0 && _table[_in_flight].deadline_us != 0 && _table[_in_flight].deadline_us <= now) {
+        outstanding_t *e = &_table[_in_flight];
+        _in_flight = -1;
+        if (e->tries > RELIABLE_MAX_RETRIES) {
+            ESP_LOGE(TAG, "No ACK after %d retries: frame type %d to node %d.", RELIABLE_MAX_RETRIES, e->frame[0], e->frame[1]);
+            stats_count(STATS_DELIVERY_FAILED);
+            remove_entry(e - _table);
+        } else {
+            int backoff_ms = exchange_ms(e->len) << (e->tries - 1);
+            if (backoff_ms > RELIABLE_MAX_BACKOFF_MS) backoff_ms = RELIABLE_MAX_BACKOFF_MS;
+            e->due_us = now + (int64_t)backoff_ms * 1000;
+            e->deadline_us = 0;
+            stats_count(STATS_RETRIES);
+            ESP_LOGW(TAG, "Retry %d for frame type %d to node %d in %d ms.", e->tries, e->frame[0], e->frame[1], backoff_ms);
+        }
+    }
+
+    // Next frame: the earliest due, new frames (due 0) first in table order
+    if (_in_flight < 0) {
+        int next = -1;
+        for (int i = 0; i < _count; i++) {
+            if (next < 0 || _table[i].due_us < _table[next].due_us) next = i;
+        }
+        if (next >= 0 && _table[next].due_us <= now) {
+            outstanding_t *e = &_table[next];
+            long frame_us = airtime_us(e->len);
+            int64_t wait_us = duty_wait_us(DUTY_DOWNLINK_CHANNEL, frame_us, DUTY_PRIO_REQUEST);
+            if (wait_us != 0) {
+                if (wait_us < 0) {
+                    ESP_LOGE(TAG, "Frame type %d to node %d exceeds the duty cycle budget.", e->frame[0], e->frame[1]);
+                    stats_count(STATS_DUTY_DROPPED);
+                    remove_entry(next);
+                    return reliable_poll();
+                }
+                ESP_LOGW(TAG, "Frame type %d to node %d deferred %lld ms for airtime.", e->frame[0], e->frame[1],
+                         (long long)(wait_us / 1000));
+                e->due_us = now + wait_us;
+                stats_count(STATS_DUTY_DEFERRED);
+            } else if (hal_radio_send(e->frame, e->len, RELIABLE_TX_QUEUE_TIMEOUT_MS)) {
+                duty_record(DUTY_DOWNLINK_CHANNEL, frame_us);
+                e->tries++;
+                e->sent_us = now;
+                e->deadline_us = 0;
+                _in_flight = next;
+            } else {
+                e->due_us = now + (int64_t)RELIABLE_TX_QUEUE_TIMEOUT_MS * 1000;
+            }
+        }
+    }
+
+    // Next timer
+    if (_count == 0) return -1;
+    int64_t next_us = INT64_MAX;
+    if (_in_flight >= 0 && _table[_in_flight].deadline_us == 0) {
+        // TxDone at the earliest after the frame's time on air
+        outstanding_t *e = &_table[_in_flight];
+        next_us = e->sent_us + airtime_us(e->len);
+        if (next_us < now + RELIABLE_TX_DONE_POLL_MS * 1000) next_us = now + RELIABLE_TX_DONE_POLL_MS * 1000;
+    } else if (_in_flight >= 0) {
+        next_us = _table[_in_flight].deadline_us;
+    } else {
+        for (int i = 0; i < _count; i++) {
+            if (_table[i].due_us < next_us) next_us = _table[i].due_us;
+        }
+    }
+    return next_us > now ? (int)((next_us - now + 999) / 1000) : 0;
+}
+
+// Stop delivering frames of a type to a node, e.g. once its reply showed
+// the frame arrived
+void reliable_cancel(uint8_t id, uint8_t type) {
+    for (int i = _count - 1; i >= 0; i--) {
+        if (entry_hdr(i)->id == id && entry_hdr(i)->type == type) remove_entry(i);
+    }
+}
+
+// Frames waiting for an ACK
+int reliable_pending(void) {
+    return _count;
+}
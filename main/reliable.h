@@ -0,0 +1,29 @@
+/* Reliable delivery of gateway -> node frames
+ *
+ * Frames the node has to acknowledge are kept in a small table until an
+ * ACK with the same node id and sequence number comes back. The radio is
+ * half-duplex, so one frame at a time is on air or waiting for its ACK;
+ * the others wait in the table while the gateway keeps receiving. A frame
+ * that is not acknowledged within the ACK's time on air after its TxDone
+ * is sent again after an exponentially growing backoff.
+ *
+ * Everything runs in the caller's task: ACKs are fed in from its RX
+ * dispatch and retransmits happen in reliable_poll(), which picks up the
+ * TxDone of a frame it sent on a later call instead of waiting for it.
+ */
+
+#ifndef __RELIABLE_H__
+#define __RELIABLE_H__
+
+#include <stdint.h>
+
+#define RELIABLE_MAX_OUTSTANDING 8 // Frames in the table, all nodes
+#define RELIABLE_MAX_RETRIES 3
+
+int reliable_send(uint8_t *frame, int len);
+int reliable_ack(uint8_t *buf, int len);
+int reliable_poll(void);
+void reliable_cancel(uint8_t id, uint8_t type);
+int reliable_pending(void);
+
+#endif
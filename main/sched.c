@@ -0,0 +1,57 @@
+/* Deadline scheduler of the gateway task: named one-shot timers */
+
+#include <stdint.h>
+
+#include "hal.h"
+#include "sched.h"
+
+static int64_t deadline_us[SCHED_TIMERS];
+static uint8_t armed[SCHED_TIMERS];
+
+// Arm a timer for the HAL time t_us, replacing its previous deadline
+void sched_at(int timer, int64_t t_us) {
+    deadline_us[timer] = t_us;
+    armed[timer] = 1;
+}
+
+void sched_in_ms(int timer, int ms) {
+    sched_at(timer, hal_time_us() + (int64_t)ms * 1000);
+}
+
+void sched_cancel(int timer) {
+    armed[timer] = 0;
+}
+
+int sched_armed(int timer) {
+    return armed[timer];
+}
+
+// Deadline of an armed timer, INT64_MAX if idle
+int64_t sched_deadline(int timer) {
+    return armed[timer] ? deadline_us[timer] : INT64_MAX;
+}
+
+// Returns 1 and disarms the timer if its deadline has passed
+int sched_due(int timer) {
+    if (!armed[timer] || deadline_us[timer] > hal_time_us()) return 0;
+    armed[timer] = 0;
+    return 1;
+}
+
+// Earliest armed deadline, INT64_MAX if no timer is armed
+int64_t sched_next_deadline(void) {
+    int64_t next_us = INT64_MAX;
+    for (int i = 0; i < SCHED_TIMERS; i++) {
+        if (armed[i] && deadline_us[i] < next_us) next_us = deadline_us[i];
+    }
+    return next_us;
+}
+
+// Milliseconds until the earliest armed deadline, 0 if one is due, -1 if
+// no timer is armed
+int sched_next_ms(void) {
+    int64_t next_us = sched_next_deadline();
+    if (next_us == INT64_MAX) return -1;
+    int64_t left_us = next_us - hal_time_us();
+    return left_us > 0 ? (int)((left_us + 999) / 1000) : 0;
+}
@@ -0,0 +1,37 @@
+/* Deadline scheduler of the gateway task
+ *
+ * A fixed set of named timers, each idle or armed with a HAL time deadline.
+ * The gateway task sleeps or receives only until the earliest deadline and
+ * then handles whatever is due, so join windows, slot switches,
+ * retransmits, the next cycle and the flushes in between are all timed
+ * events rather than fixed sleeps. There are only a few timers, so they
+ * are kept in a plain array and scanned.
+ *
+ * Everything runs in the gateway task.
+ */
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+
+// Timers
+#define SCHED_CYCLE 0      // Start of the next gateway cycle
+#define SCHED_FLUSH 1      // Backhaul and node store flush, between cycles
+#define SCHED_PHASE 2      // End of the current phase of the cycle
+#define SCHED_WINDOW 3     // End of a receive window within the phase, e.g. an Open interval
+#define SCHED_SLOT 4       // Next group of uplink slots
+#define SCHED_DRAIN 5      // Give up waiting for ACKs
+#define SCHED_RETRANSMIT 6 // Next timer of reliable delivery
+#define SCHED_TIMERS 7
+
+void sched_at(int timer, int64_t t_us);
+void sched_in_ms(int timer, int ms);
+void sched_cancel(int timer);
+int sched_armed(int timer);
+int64_t sched_deadline(int timer);
+int sched_due(int timer);
+int64_t sched_next_deadline(void);
+int sched_next_ms(void);
+
+#endif
@@ -0,0 +1,123 @@
+/* Gateway statistics: event counters and per-node latency histograms */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#include "hal.h"
+#include "node_table.h"
+#include "duty.h"
+#include "stats.h"
+
+static const char *counter_names[STATS_COUNTERS] = {
+    [STATS_JOINS] = "joins",
+    [STATS_RETRIES] = "retries",
+    [STATS_DELIVERY_FAILED] = "delivery failed",
+    [STATS_MISSED_SLOTS] = "missed slots",
+    [STATS_REPOLLS_ANSWERED] = "re-polls answered",
+    [STATS_CYCLES] = "cycles",
+    [STATS_DUTY_DROPPED] = "duty cycle dropped",
+    [STATS_DUTY_DEFERRED] = "duty cycle deferred",
+    [STATS_DUPLICATES] = "duplicates",
+    [STATS_DELTAS] = "deltas",
+    [STATS_DELTA_REJECTED] = "deltas rejected",
+    [STATS_ALERTS] = "alerts",
+};
+
+static uint32_t counters[STATS_COUNTERS];
+static stats_latency_t latency[CONFIG_MAX_NODES]; // By uplink slot
+static stats_power_t power;
+
+void stats_count(int counter) {
+    counters[counter]++;
+}
+
+uint32_t stats_get(int counter) {
+    return counters[counter];
+}
+
+static int latency_bucket(int ms) {
+    int b = 0;
+    for (int limit = STATS_LATENCY_BASE_MS; b < STATS_LATENCY_BUCKETS - 1 && ms >= limit; limit <<= 1) b++;
+    return b;
+}
+
+// Histogram of a known node, reset when its slot changed hands
+static stats_latency_t *node_latency(uint8_t id, int reset) {
+    int slot = node_table_slot(id);
+    if (slot < 0) return NULL;
+    stats_latency_t *h = &latency[slot];
+    if (h->id != id || h->samples == 0) {
+        if (!reset) return NULL;
+        memset(h, 0, sizeof(*h));
+        h->id = id;
+    }
+    return h;
+}
+
+// Record the response latency of a node
+void stats_latency(uint8_t id, int ms) {
+    stats_latency_t *h = node_latency(id, 1);
+    if (h == NULL) return;
+    if (ms < 0) ms = 0;
+    if (h->samples == UINT16_MAX) return; // Keep mean and histogram consistent
+    h->samples++;
+    h->sum_ms += ms;
+    if ((uint32_t)ms > h->max_ms) h->max_ms = ms;
+    h->bucket[latency_bucket(ms)]++;
+}
+
+// Latency histogram of a node, NULL if it has no samples
+const stats_latency_t *stats_node_latency(uint8_t id) {
+    return node_latency(id, 0);
+}
+
+// Record a power save wake-up of the radios
+void stats_wake(int64_t slept_us, int64_t latency_us, int64_t lead_us) {
+    power.wakes++;
+    power.slept_us += slept_us;
+    power.latency_sum_us += latency_us;
+    if (latency_us > power.latency_max_us) power.latency_max_us = (int32_t)latency_us;
+    power.lead_us = (int32_t)lead_us;
+}
+
+const stats_power_t *stats_power(void) {
+    return &power;
+}
+
+void stats_clear(void) {
+    memset(counters, 0, sizeof(counters));
+    memset(latency, 0, sizeof(latency));
+    memset(&power, 0, sizeof(power));
+    hal_radio_clear_stats();
+}
+
+// Print every counter and histogram, radio driver included
+void stats_dump(void) {
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        printf("%s %" PRIu32 "%s", counter_names[i], counters[i], i == STATS_COUNTERS - 1 ? "\n" : ", ");
+    }
+    hal_radio_dump_stats();
+    printf("Duty cycle: %" PRId64 " of %" PRId64 " ms airtime used\n", duty_used_us(DUTY_DOWNLINK_CHANNEL) / 1000,
+           duty_budget_us() / 1000);
+    if (power.wakes > 0) {
+        printf("Power save: %" PRIu32 " wakes, radios asleep %" PRId64 " s, wake to RX mean %" PRId64 " us, max %" PRId32
+               " us, lead %" PRId32 " us\n", power.wakes, power.slept_us / 1000000, power.latency_sum_us / power.wakes,
+               power.latency_max_us, power.lead_us);
+    }
+
+    printf("node  n     mean  max   ");
+    for (int b = 0, limit = STATS_LATENCY_BASE_MS; b < STATS_LATENCY_BUCKETS; b++, limit <<= 1) {
+        printf(b < STATS_LATENCY_BUCKETS - 1 ? "<%-5d" : ">=%-5d", b < STATS_LATENCY_BUCKETS - 1 ? limit : limit >> 1);
+    }
+    printf("(ms)\n");
+    for (int slot = 0; slot < CONFIG_MAX_NODES; slot++) {
+        const stats_latency_t *h = &latency[slot];
+        if (h->samples == 0 || node_table_at(slot) == NULL || node_table_at(slot)->id != h->id) continue;
+        printf("%-5d %-5d %-5" PRIu32 " %-5" PRIu32 " ", h->id, h->samples, h->sum_ms / h->samples, h->max_ms);
+        for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) printf("%-6d", h->bucket[b]);
+        printf("\n");
+    }
+}
@@ -0,0 +1,63 @@
+/* Gateway statistics
+ *
+ * Event counters of the gateway cycle and per-node response latency
+ * histograms. Latency runs from queueing a data request to the node's
+ * data frame, so request retries show up in the tail. The radio driver keeps its
+ * own counters, see lora_get_stats(); stats_dump() prints both, the
+ * airtime used in the duty cycle window and, with power save, the radio
+ * sleep time and the wake-to-RX latency (power.h).
+ *
+ * Everything is updated from the gateway task.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+// Counters
+#define STATS_JOINS 0            // Join frames accepted
+#define STATS_RETRIES 1          // Downlink retransmissions
+#define STATS_DELIVERY_FAILED 2  // Downlinks given up after the last retry
+#define STATS_MISSED_SLOTS 3     // Known nodes silent in their uplink slot
+#define STATS_REPOLLS_ANSWERED 4 // Missed slots recovered by a re-poll
+#define STATS_CYCLES 5
+#define STATS_DUTY_DROPPED 6     // Downlinks dropped to stay within the duty cycle
+#define STATS_DUTY_DEFERRED 7    // Downlinks deferred to stay within the duty cycle
+#define STATS_DUPLICATES 8       // Copies of a stored data frame, not stored again
+#define STATS_DELTAS 9           // Delta data frames expanded
+#define STATS_DELTA_REJECTED 10  // Delta data frames without a reading to refer to
+#define STATS_ALERTS 11          // Readings outside the reporting thresholds
+#define STATS_COUNTERS 12
+
+// Latency buckets: < STATS_LATENCY_BASE_MS, doubling, the last is open-ended
+#define STATS_LATENCY_BUCKETS 8
+#define STATS_LATENCY_BASE_MS 50
+
+typedef struct {
+    uint8_t id;
+    uint16_t samples;
+    uint32_t sum_ms;
+    uint32_t max_ms;
+    uint16_t bucket[STATS_LATENCY_BUCKETS];
+} stats_latency_t;
+
+// Power save wake-ups, see power_idle()
+typedef struct {
+    uint32_t wakes;
+    int64_t slept_us;        // Radios asleep, from the sleep request to back in receive
+    int64_t latency_sum_us;  // Wake-to-RX latency
+    int32_t latency_max_us;
+    int32_t lead_us;         // Wake-up lead after the last wake-up
+} stats_power_t;
+
+void stats_count(int counter);
+uint32_t stats_get(int counter);
+void stats_latency(uint8_t id, int ms);
+const stats_latency_t *stats_node_latency(uint8_t id);
+void stats_wake(int64_t slept_us, int64_t latency_us, int64_t lead_us);
+const stats_power_t *stats_power(void);
+void stats_clear(void);
+void stats_dump(void);
+
+#endif
@@ -0,0 +1,170 @@
+/* Gateway benchmark on the simulated channel
+ *
+ * Runs gateway_cycle() against N simulated nodes and reports, per cycle,
+ * how long the cycle took, how many readings it delivered, the airtime of
+ * all frames (the offered load, overlapping frames counted in full) and
+ * the share of the cycle period the uplink channels were busy. Each node count runs in its own
+ * process, so the gateway's static state starts fresh.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "hal.h"
+#include "gateway.h"
+#include "stats.h"
+#include "sched.h"
+#include "power.h"
+#include "sim.h"
+
+#define BENCH_MAX_RUNS 16
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n nodes[,nodes...]] [-c cycles] [-r radios] [-l loss] [-s seed] [-v level] [-d]\n"
+            "  -n  node counts, one run each (default 20,100,255)\n"
+            "  -c  cycles per run (default 10)\n"
+            "  -r  gateway radios, 1 or 2 (default 1)\n"
+            "  -l  random frame loss probability (default 0.02)\n"
+            "  -s  random seed (default 1)\n"
+            "  -v  gateway log level, 0 none to 4 debug (default 1)\n"
+            "  -d  dump the gateway statistics after each run\n",
+            prog);
+}
+
+static void run(sim_config_t *cfg, int cycles, int dump) {
+    sim_init(cfg);
+    gateway_init(0);
+
+    printf("\n%d nodes, %d radio(s), %d channel(s), loss %.2f, seed %u\n", cfg->nodes, cfg->receivers, CONFIG_LORA_CHANNELS,
+           cfg->loss, cfg->seed);
+    printf("cycle  time ms  joined  readings  airtime ms  busy %%\n");
+
+    // Steady state: the second half of the run
+    int steady_from = cycles / 2;
+    int64_t steady_time_us = 0, steady_busy_us = 0, steady_period_us = 0;
+    uint32_t steady_readings = 0;
+
+    for (int c = 0; c < cycles; c++) {
+        // Idle as the gateway task does until the cycle timer is due, armed by
+        // gateway_init() or the last cycle
+        sim_stats_t before, after;
+        sim_get_stats(&before);
+        while (!sched_due(SCHED_CYCLE)) {
+            if (sched_next_ms() == 0) {
+                fprintf(stderr, "a timer the gateway task does not serve is due\n");
+                exit(1);
+            }
+            power_idle();
+        }
+        int64_t start_us = hal_time_us();
+        gateway_cycle();
+        int64_t time_us = hal_time_us() - start_us;
+        sched_due(SCHED_FLUSH); // Nothing to flush on the host
+        int64_t period_us = sched_deadline(SCHED_CYCLE) - start_us;
+        sim_get_stats(&after);
+
+        uint32_t readings = after.readings - before.readings;
+        int64_t airtime_us = after.airtime_us - before.airtime_us;
+        int64_t busy_us = after.busy_us - before.busy_us;
+        printf("%5d  %7lld  %6d  %8u  %10lld  %6.1f\n", c, (long long)(time_us / 1000), after.joined, readings,
+               (long long)(airtime_us / 1000), 100.0 * busy_us / (CONFIG_LORA_CHANNELS * period_us));
+
+        if (c >= steady_from) {
+            steady_time_us += time_us;
+            steady_busy_us += busy_us;
+            steady_period_us += period_us;
+            steady_readings += readings;
+        }
+    }
+
+    int steady = cycles - steady_from;
+    sim_stats_t total;
+    sim_get_stats(&total);
+    printf("steady state (cycles %d-%d): %.0f ms per cycle, %.1f of %d readings per cycle, channels %.1f %% busy\n",
+           steady_from, cycles - 1, steady_time_us / 1000.0 / steady, (double)steady_readings / steady, cfg->nodes,
+           100.0 * steady_busy_us / (CONFIG_LORA_CHANNELS * steady_period_us));
+    printf("uplinks %u: %u collided, %u lost\n", total.uplinks, total.collisions, total.lost);
+    if (total.alerts > 0) printf("%u readings pushed as alerts, %u woke the backhaul during a cycle\n", total.alerts, total.alert_wakes);
+    const stats_power_t *power = stats_power();
+    if (power->wakes > 0) {
+        printf("radios asleep %.1f %% of the time, wake to RX mean %lld us, max %d us\n",
+               100.0 * power->slept_us / hal_time_us(), (long long)(power->latency_sum_us / power->wakes),
+               (int)power->latency_max_us);
+    }
+    if (dump) stats_dump();
+}
+
+int main(int argc, char **argv) {
+    sim_config_t cfg = {
+        .loss = 0.02,
+        .snr_min_db = -5.0f,
+        .snr_max_db = 15.0f,
+        .seed = 1,
+        .receivers = 1,
+    };
+    int counts[BENCH_MAX_RUNS] = { 20, 100, 255 };
+    int runs = 3;
+    int cycles = 10;
+    int dump = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:r:l:s:v:dh")) != -1) {
+        switch (opt) {
+        case 'n':
+            runs = 0;
+            for (char *tok = strtok(optarg, ","); tok && runs < BENCH_MAX_RUNS; tok = strtok(NULL, ",")) {
+                counts[runs++] = atoi(tok);
+            }
+            break;
+        case 'c':
+            cycles = atoi(optarg);
+            break;
+        case 'r':
+            cfg.receivers = atoi(optarg);
+            break;
+        case 'l':
+            cfg.loss = atof(optarg);
+            break;
+        case 's':
+            cfg.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            sim_log_level = atoi(optarg);
+            break;
+        case 'd':
+            dump = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cycles < 1) cycles = 1;
+
+    for (int i = 0; i < runs; i++) {
+        if (counts[i] < 1 || counts[i] > 255) {
+            fprintf(stderr, "node count %d out of range (1-255)\n", counts[i]);
+            return 1;
+        }
+        cfg.nodes = counts[i];
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            run(&cfg, cycles, dump);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return 1;
+    }
+    return 0;
+}
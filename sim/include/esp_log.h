@@ -0,0 +1,18 @@
+/* ESP_LOGx on the host: printed with the simulated time, see sim_log() */
+
+#pragma once
+
+#include "sdkconfig.h"
+
+#define SIM_LOG_ERROR 1
+#define SIM_LOG_WARN 2
+#define SIM_LOG_INFO 3
+#define SIM_LOG_DEBUG 4
+
+void sim_log(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, fmt, ...) sim_log(SIM_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) sim_log(SIM_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) sim_log(SIM_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) sim_log(SIM_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) sim_log(SIM_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
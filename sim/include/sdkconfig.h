@@ -0,0 +1,26 @@
+/* Host build configuration of the gateway logic, in place of the
+ * sdkconfig.h generated by ESP-IDF. Sized for the largest benchmark. */
+
+#pragma once
+
+#define CONFIG_MAX_NODES 255
+#define CONFIG_LEGACY_ASCII 1
+#define CONFIG_IMPLICIT_SLOTS 1
+#define CONFIG_DATA_DELTA 1
+#ifndef CONFIG_EXCEPTION_REPORTING // SIM_EXCEPTIONS in CMake
+#define CONFIG_EXCEPTION_REPORTING 0
+#endif
+#define CONFIG_EXCEPTION_HEARTBEAT_CYCLES 10
+#define CONFIG_ADR 1
+#define CONFIG_ADR_MARGIN_DB 10
+#define CONFIG_STATS_DUMP_CYCLES 0
+#ifndef CONFIG_LORA_CHANNELS // SIM_CHANNELS in CMake
+#define CONFIG_LORA_CHANNELS 1
+#endif
+#define CONFIG_LORA_CHANNEL_SPACING_KHZ 200
+#define CONFIG_DUTY_CYCLE 1
+#define CONFIG_DUTY_CYCLE_PERMILLE 10
+#define CONFIG_DUTY_CYCLE_WINDOW_S 3600
+#define CONFIG_POWER_SAVE 1
+#define CONFIG_POWER_SAVE_MIN_IDLE_MS 100
+#define CONFIG_POWER_SAVE_WAKE_LEAD_MS 5
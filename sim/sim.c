@@ -0,0 +1,735 @@
+/* Simulated LoRa channel and nodes, see sim.h */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+
+#include "esp_log.h"
+
+#include "hal.h"
+#include "protocol.h"
+#include "telemetry.h"
+#include "gateway.h"
+#include "sim.h"
+
+#define SIM_GATEWAY -1
+#define SIM_MAX_NODES 255         // Ids 0 to 254, 0xff is the broadcast id
+#define SIM_MAX_FRAMES 4096
+#define SIM_HISTORY_US 10000000LL // Frames kept for overlap checks, longer than any frame
+#define SIM_RX_QUEUE_LEN 8        // As CONFIG_RADIO_RX_QUEUE_LEN
+
+#define SIM_TURNAROUND_US 5000    // Node RX to TX switch and processing
+#define SIM_SLOT_JITTER_US 2000   // Node clock error at its slot start
+#define SIM_SNR_JITTER_DB 1.0f    // Per frame fading, uniform +-
+#define SIM_T_STEP 20             // Reading change per data frame, uniform +-, 0.01 degree C
+#define SIM_H_STEP 30             // 0.01 %RH
+#define SIM_HOME_PULL 16          // A reading moves back 1/16 of its distance from home per step
+#define SIM_TX_QUEUE_LEN 4        // As CONFIG_RADIO_TX_QUEUE_LEN
+#define SIM_CAD_MAX_TRIES 5       // Busy channel checks before sending anyway, as CONFIG_RADIO_LBT_MAX_TRIES
+#define SIM_CAD_BACKOFF_US 10000  // Backoff unit, doubled on every busy check
+#define SIM_MAX_RADIOS 2          // As CONFIG_LORA_RADIO_COUNT
+#define SIM_WAKE_US 1200          // Sleep to RX: oscillator start, mode switches and the radio task
+
+typedef struct {
+    int64_t start_us;
+    int64_t end_us;
+    int sender; // Node index, SIM_GATEWAY for the gateway
+    long frequency;
+    uint8_t sf;
+    uint8_t bw;
+    uint8_t implicit;
+    uint8_t len;
+    uint8_t delivered;
+    uint8_t pending; // Waiting for a free channel (CAD) at start_us, not on air yet
+    uint8_t tries;
+    uint8_t payload[PROTO_MAX_LEN];
+} sim_frame_t;
+
+typedef struct {
+    uint8_t id;
+    float snr_db; // Link SNR at 125 kHz
+    int joined;
+    int slot;
+    proto_rate_t rate;
+    int64_t busy_until_us; // End of its last frame
+    int16_t t;             // Current reading, wire units
+    uint16_t h;
+    int16_t t_home;        // The reading drifts around these
+    uint16_t h_home;
+    int has_sample;        // t, h were taken for sample_seq
+    uint8_t sample_seq;
+    int exceptions;        // The last beacon asked for exception reporting with exc
+    proto_beacon_exceptions_t exc;
+    int sent_out;          // The last data frame was out of the exc thresholds
+    int delta;             // The last beacon allowed delta frames
+    int acked;             // The last data frame was acknowledged by an Ok: t_ref, h_ref valid
+    int16_t t_ref;
+    uint16_t h_ref;
+    int has_sent;          // sent_* hold the last data frame, resent as is for the same seq
+    uint8_t sent_seq;
+    int16_t sent_t;
+    uint16_t sent_h;
+    uint8_t sent_len;
+    uint8_t sent[sizeof(proto_data_t)];
+} sim_node_t;
+
+// Gateway radio, as run by its radio task
+typedef struct {
+    lora_profile_t profile;
+    int64_t profile_us; // Time the current setting took effect
+    int listening;      // Receiver 0 always, the others after hal_radio_set_receiver()
+    int asleep;         // Since hal_radio_sleep()
+} sim_radio_t;
+
+// Request to the gateway's radio tasks
+#define SIM_CMD_SEND 0
+#define SIM_CMD_PROFILE 1  // Every radio, back to its base role
+#define SIM_CMD_RECEIVER 2 // One radio listens with its own setting
+#define SIM_CMD_SLEEP 3    // Every radio sleeps, or wakes up after SIM_WAKE_US
+
+typedef struct {
+    int op;
+    int rx; // SIM_CMD_RECEIVER
+    int sleep; // SIM_CMD_SLEEP
+    lora_profile_t profile;
+    uint8_t len;
+    uint8_t payload[PROTO_MAX_LEN];
+} sim_cmd_t;
+
+int sim_log_level = SIM_LOG_ERROR;
+
+static sim_config_t config;
+static sim_stats_t stats;
+static sim_node_t nodes[SIM_MAX_NODES];
+static sim_frame_t frames[SIM_MAX_FRAMES];
+static int frame_count;
+static int64_t now_us;
+static uint64_t rng;
+
+// With more than one radio, the last one transmits, as in hal_esp32.c
+static sim_radio_t radios[SIM_MAX_RADIOS];
+static int radio_count;
+#define SIM_TX_RADIO (&radios[radio_count - 1])
+static int64_t gw_tx_end_us; // End of the last gateway frame
+static int gw_sending;       // A gateway frame waits for the channel or is on air
+static sim_cmd_t tx_queue[SIM_TX_QUEUE_LEN];
+static int tx_head;
+static int tx_count;
+
+static lora_packet_t rx_queue[SIM_RX_QUEUE_LEN];
+static int rx_head;
+static int rx_count;
+static int rx_dropped;
+static uint32_t rx_errors; // Collisions a gateway radio locked on to, see collision_heard()
+
+// Demodulation SNR floor per spreading factor (SX127x datasheet), as in adr.c
+static const float snr_floor_db[13] = {
+    [6] = -5.0f, [7] = -7.5f, [8] = -10.0f, [9] = -12.5f, [10] = -15.0f, [11] = -17.5f, [12] = -20.0f,
+};
+
+// xorshift64*, so runs are repeatable for a given seed
+static uint32_t rand_u32(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (uint32_t)((rng * 2685821657736338717ULL) >> 32);
+}
+
+static double rand_unit(void) {
+    return rand_u32() / 4294967296.0;
+}
+
+static float bw_offset_db(int bw) {
+    return 10.0f * log10f(lora_bandwidth_hz(bw) / 125000.0f);
+}
+
+// Frames that can collide, or be detected by CAD
+static int same_channel(const sim_frame_t *a, const sim_frame_t *b) {
+    return a->frequency == b->frequency && a->sf == b->sf && a->bw == b->bw;
+}
+
+static int overlaps(const sim_frame_t *a, const sim_frame_t *b) {
+    return !a->pending && !b->pending && a->start_us < b->end_us && b->start_us < a->end_us;
+}
+
+static int same_frame(const sim_frame_t *a, const sim_frame_t *b) {
+    return a->sender == b->sender && a->start_us == b->start_us;
+}
+
+// In-band SNR of one frame from a node, returns 0 if it cannot be demodulated
+static int link_ok(const sim_node_t *n, int sf, int bw, float *snr) {
+    float jitter = (float)(rand_unit() * 2 - 1) * SIM_SNR_JITTER_DB;
+    *snr = n->snr_db + jitter - bw_offset_db(bw);
+    return *snr >= snr_floor_db[sf];
+}
+
+// Drop frames nothing can overlap anymore
+static void compact(void) {
+    int n = 0;
+    for (int i = 0; i < frame_count; i++) {
+        if (frames[i].delivered && frames[i].end_us < now_us - SIM_HISTORY_US) continue;
+        if (n != i) frames[n] = frames[i];
+        n++;
+    }
+    frame_count = n;
+}
+
+static long frame_airtime_us(const sim_frame_t *f) {
+    return lora_airtime_us(f->sf, f->bw, gateway_profile.cr, gateway_profile.crc, f->implicit, LORA_DEFAULT_PREAMBLE, f->len);
+}
+
+static void count_airtime(const sim_frame_t *f) {
+    long airtime_us = f->end_us - f->start_us;
+    stats.airtime_us += airtime_us;
+    if (f->sender == SIM_GATEWAY) {
+        stats.gateway_airtime_us += airtime_us;
+    } else {
+        stats.uplinks++;
+    }
+}
+
+// Part of a frame that just ended not already covered by the frames that
+// ended before it on its frequency. The overlapping ones only need sorting
+// by start, as none of them lasts past its end.
+static int64_t busy_us(const sim_frame_t *f) {
+    static int64_t starts[SIM_MAX_FRAMES], ends[SIM_MAX_FRAMES];
+    int count = 0;
+    for (int i = 0; i < frame_count; i++) {
+        const sim_frame_t *g = &frames[i];
+        if (!g->delivered || same_frame(g, f) || g->frequency != f->frequency || g->end_us <= f->start_us) continue;
+        int64_t start_us = g->start_us > f->start_us ? g->start_us : f->start_us;
+        int j = count++;
+        for (; j > 0 && starts[j - 1] > start_us; j--) {
+            starts[j] = starts[j - 1];
+            ends[j] = ends[j - 1];
+        }
+        starts[j] = start_us;
+        ends[j] = g->end_us;
+    }
+    int64_t covered_us = 0, until_us = f->start_us;
+    for (int i = 0; i < count; i++) {
+        if (ends[i] <= until_us) continue;
+        covered_us += ends[i] - (starts[i] > until_us ? starts[i] : until_us);
+        until_us = ends[i];
+    }
+    return f->end_us - f->start_us - covered_us;
+}
+
+// Put a frame on air, or with cad set, ask for a channel check at start_us
+// first. Returns its end time (start_us for a CAD frame), or -1 if the frame
+// table is full.
+static int64_t add_frame(int sender, int64_t start_us, long frequency, int sf, int bw, int implicit, int cad, const void *buf, int len) {
+    if (frame_count == SIM_MAX_FRAMES) compact();
+    if (frame_count == SIM_MAX_FRAMES || len > PROTO_MAX_LEN) {
+        ESP_LOGE("SIM", "Frame table full, frame dropped.");
+        return -1;
+    }
+
+    sim_frame_t *f = &frames[frame_count++];
+    f->start_us = start_us;
+    f->sender = sender;
+    f->frequency = frequency;
+    f->sf = sf;
+    f->bw = bw;
+    f->implicit = implicit != 0;
+    f->len = len;
+    f->delivered = 0;
+    f->pending = cad != 0;
+    f->tries = 0;
+    memcpy(f->payload, buf, len);
+    f->end_us = start_us;
+    if (f->pending) return f->end_us;
+
+    f->end_us += frame_airtime_us(f);
+    count_airtime(f);
+    return f->end_us;
+}
+
+// Nodes are half-duplex too: a node sends its frames back to back
+static int64_t node_send(sim_node_t *n, int64_t start_us, long frequency, int sf, int bw, int implicit, const void *buf, int len) {
+    if (start_us < n->busy_until_us) start_us = n->busy_until_us;
+    int64_t end_us = add_frame(n - nodes, start_us, frequency, sf, bw, implicit, 0, buf, len);
+    if (end_us > 0) n->busy_until_us = end_us;
+    return end_us;
+}
+
+static int in_delta_range(int v) {
+    return v >= INT8_MIN && v <= INT8_MAX;
+}
+
+// Take the reading for cycle seq: a random step, pulled back toward home
+static void node_sample(sim_node_t *n, uint8_t seq) {
+    if (n->has_sample && seq == n->sample_seq) return;
+    n->t += (int)(rand_u32() % (2 * SIM_T_STEP + 1)) - SIM_T_STEP - (n->t - n->t_home) / SIM_HOME_PULL;
+    n->h += (int)(rand_u32() % (2 * SIM_H_STEP + 1)) - SIM_H_STEP - ((int)n->h - n->h_home) / SIM_HOME_PULL;
+    n->has_sample = 1;
+    n->sample_seq = seq;
+}
+
+static int node_out_of_range(const sim_node_t *n) {
+    return n->t < n->exc.t_min || n->t > n->exc.t_max || n->h < n->exc.h_min || n->h > n->exc.h_max;
+}
+
+// Exception reporting: whether the node has something to send in its slot
+static int node_slot_due(const sim_node_t *n, uint8_t cycle) {
+    int hb = n->exc.heartbeat_cycles ? n->exc.heartbeat_cycles : 1;
+    return node_out_of_range(n) || n->sent_out || !n->acked || cycle % hb == n->slot % hb;
+}
+
+// Send the current reading, as a delta when the gateway takes one and the
+// change fits. The answer to a repeated request is the same frame again.
+static void node_send_data(sim_node_t *n, int64_t start_us, long frequency, int sf, int bw, int implicit, uint8_t seq) {
+    if (!n->has_sent || seq != n->sent_seq) {
+        node_sample(n, seq);
+        int dt = n->t - n->t_ref, dh = n->h - n->h_ref;
+        if (n->delta && !implicit && n->acked && in_delta_range(dt) && in_delta_range(dh)) {
+            proto_data_delta_t delta = { .hdr = { PROTO_DATA_DELTA, n->id, seq }, .dt = dt, .dh = dh };
+            memcpy(n->sent, &delta, sizeof(delta));
+            n->sent_len = sizeof(delta);
+        } else {
+            proto_data_t data = { .hdr = { PROTO_DATA, n->id, seq }, .t = n->t, .h = n->h };
+            memcpy(n->sent, &data, sizeof(data));
+            n->sent_len = sizeof(data);
+        }
+        n->has_sent = 1;
+        n->sent_seq = seq;
+        n->sent_t = n->t;
+        n->sent_h = n->h;
+        n->sent_out = n->exceptions && node_out_of_range(n);
+        n->acked = 0; // Until the Ok says it was stored
+    }
+    node_send(n, start_us, frequency, sf, bw, implicit, n->sent, n->sent_len);
+}
+
+// Node firmware: react to a frame of the gateway
+static void node_receive(sim_node_t *n, const sim_frame_t *f) {
+    const proto_hdr_t *hdr = proto_hdr(f->payload);
+    long base_hz = gateway_profile.frequency;
+    int base_sf = gateway_profile.sf, base_bw = gateway_profile.bw;
+
+    switch (hdr->type) {
+    case PROTO_OPEN: {
+        const proto_open_t *open = (const proto_open_t *)f->payload;
+        if (n->joined || open->id_split == 0 || n->id % open->id_split != open->id_group) return;
+        int64_t delay_us = open->backoff_ms ? rand_u32() % (open->backoff_ms * 1000u) : 0;
+        proto_join_t join = {
+            .hdr = { PROTO_JOIN, n->id, 0 },
+            .latitude = 210000000 + n->id,
+            .longitude = 1058000000 + n->id,
+        };
+        add_frame(n - nodes, f->end_us + SIM_TURNAROUND_US + delay_us, base_hz, base_sf, base_bw, 0, 1, &join, sizeof(join));
+        break;
+    }
+    case PROTO_ACCEPT: {
+        const proto_accept_t *accept = (const proto_accept_t *)f->payload;
+        for (int i = 0; i < accept->count; i++) {
+            if (accept->entry[i].id != n->id) continue;
+            n->joined = 1;
+            n->slot = accept->entry[i].slot;
+            n->rate = accept->entry[i].rate;
+        }
+        break;
+    }
+    case PROTO_BEACON: {
+        const proto_beacon_t *beacon = (const proto_beacon_t *)f->payload;
+        if (!n->joined || n->slot >= beacon->slot_count || beacon->channels == 0 || beacon->parallel == 0) return;
+        int64_t start_us = f->end_us + (int64_t)proto_beacon_group_ms(f->payload, n->slot / beacon->parallel) * 1000 +
+                           rand_u32() % SIM_SLOT_JITTER_US;
+        long hz = base_hz + (long)(n->slot % beacon->channels) * beacon->spacing_khz * 1000;
+        n->delta = (beacon->flags & PROTO_BEACON_DELTA) != 0;
+        n->exceptions = (beacon->flags & PROTO_BEACON_EXCEPTIONS) != 0;
+        if (n->exceptions) {
+            n->exc = *proto_beacon_exceptions(f->payload);
+            node_sample(n, hdr->seq);
+            if (!node_slot_due(n, hdr->seq)) return;
+        }
+        node_send_data(n, start_us, hz, n->rate.sf, n->rate.bw, beacon->flags & PROTO_BEACON_IMPLICIT, hdr->seq);
+        break;
+    }
+    case PROTO_REQUEST: {
+        if (hdr->id != n->id || !n->joined) return;
+        proto_hdr_t ack = { PROTO_ACK, n->id, hdr->seq };
+        int64_t end_us = node_send(n, f->end_us + SIM_TURNAROUND_US, base_hz, base_sf, base_bw, 0, &ack, sizeof(ack));
+        if (end_us > 0) node_send_data(n, end_us + SIM_TURNAROUND_US, base_hz, base_sf, base_bw, 0, hdr->seq);
+        break;
+    }
+    case PROTO_OK: {
+        const proto_ok_t *ok = (const proto_ok_t *)f->payload;
+        const proto_ok_rate_t *rate = (const proto_ok_rate_t *)(ok->data + (ok->slot_count + 7) / 8);
+        if (n->joined && n->has_sent && n->slot < ok->slot_count && (ok->data[n->slot >> 3] & (1 << (n->slot & 7)))) {
+            n->acked = 1;
+            n->t_ref = n->sent_t;
+            n->h_ref = n->sent_h;
+        }
+        for (int i = 0; i < ok->rate_count; i++) {
+            if (n->joined && rate[i].slot == n->slot) n->rate = rate[i].rate;
+        }
+        break;
+    }
+    }
+}
+
+// A gateway frame ended: every node listening on the base setting and
+// channel may get it
+static void deliver_downlink(const sim_frame_t *f) {
+    if (f->frequency != gateway_profile.frequency) return;
+
+    static int overlapping[SIM_MAX_FRAMES];
+    int count = 0;
+    for (int i = 0; i < frame_count; i++) {
+        if (!same_frame(&frames[i], f) && overlaps(&frames[i], f)) overlapping[count++] = i;
+    }
+    // Copies: node replies are added to the frame table while iterating
+    static int senders[SIM_MAX_FRAMES];
+    static int collided[SIM_MAX_FRAMES];
+    for (int j = 0; j < count; j++) {
+        const sim_frame_t *g = &frames[overlapping[j]];
+        senders[j] = g->sender;
+        collided[j] = same_channel(g, f);
+    }
+
+    for (int i = 0; i < config.nodes; i++) {
+        sim_node_t *n = &nodes[i];
+        int lost = 0;
+        for (int j = 0; j < count && !lost; j++) {
+            lost = senders[j] == i || (collided[j] && senders[j] != SIM_GATEWAY);
+        }
+        float snr;
+        if (lost || !link_ok(n, f->sf, f->bw, &snr) || rand_unit() < config.loss) continue;
+        node_receive(n, f);
+    }
+}
+
+// Listening with the frame's setting and channel since before it started
+static int radio_gets(const sim_radio_t *r, const sim_frame_t *f) {
+    const lora_profile_t *p = &r->profile;
+    int implicit = p->implicit_len != 0;
+    return r->listening && !r->asleep && p->frequency == f->frequency && p->sf == f->sf && p->bw == f->bw && implicit == f->implicit &&
+           (!implicit || p->implicit_len == f->len) && r->profile_us <= f->start_us;
+}
+
+// A radio listening to a collided frame locks on to it if it started
+// first, and then gets a CRC error
+static int collision_heard(const sim_frame_t *f) {
+    for (int i = 0; i < frame_count; i++) {
+        const sim_frame_t *g = &frames[i];
+        if (!same_frame(g, f) && overlaps(g, f) && same_channel(g, f) && g->start_us < f->start_us) return 0;
+    }
+    for (int radio = 0; radio < radio_count; radio++) {
+        if (radio_gets(&radios[radio], f)) return 1;
+    }
+    return 0;
+}
+
+// A node frame ended: decide whether a gateway radio got it
+static void deliver_uplink(const sim_frame_t *f) {
+    const sim_node_t *n = &nodes[f->sender];
+    for (int i = 0; i < frame_count; i++) {
+        const sim_frame_t *g = &frames[i];
+        if (same_frame(g, f) || !overlaps(g, f)) continue;
+        if (g->sender == SIM_GATEWAY) {
+            stats.lost++; // Half-duplex, and the TX radio blinds the others next to it
+            return;
+        }
+        if (same_channel(g, f)) {
+            stats.collisions++;
+            if (collision_heard(f)) rx_errors++;
+            return;
+        }
+    }
+
+    int radio = 0;
+    while (radio < radio_count && !radio_gets(&radios[radio], f)) radio++;
+    if (radio == radio_count) {
+        stats.lost++;
+        return;
+    }
+    float snr;
+    if (!link_ok(n, f->sf, f->bw, &snr) || rand_unit() < config.loss) {
+        stats.lost++;
+        return;
+    }
+
+    if (rx_count == SIM_RX_QUEUE_LEN) {
+        rx_dropped++;
+        return;
+    }
+    lora_packet_t *pkt = &rx_queue[(rx_head + rx_count++) % SIM_RX_QUEUE_LEN];
+    memcpy(pkt->payload, f->payload, f->len);
+    pkt->payload[f->len] = '\0';
+    pkt->len = f->len;
+    pkt->snr = roundf(snr * 4) / 4; // Register resolution
+    pkt->rssi = (int16_t)(-110 + snr + bw_offset_db(f->bw));
+    pkt->timestamp_us = f->end_us;
+    pkt->radio = radio;
+}
+
+// Channel activity detection before a join or, on the gateway, before any
+// frame (listen before talk): a frame with the same setting is detected
+// once it has been on air for a symbol
+static void channel_check(sim_frame_t *f) {
+    long symbol_us = lora_symbol_time_us(f->sf, f->bw);
+    int busy = 0;
+    for (int i = 0; i < frame_count && !busy; i++) {
+        const sim_frame_t *g = &frames[i];
+        busy = !g->pending && same_channel(g, f) && g->start_us + symbol_us <= f->start_us && g->end_us > f->start_us;
+    }
+    if (busy && f->tries < SIM_CAD_MAX_TRIES) {
+        f->tries++;
+        f->start_us += 1 + rand_u32() % (SIM_CAD_BACKOFF_US << (f->tries - 1));
+        f->end_us = f->start_us;
+        return;
+    }
+
+    // sim_node_t.busy_until_us is not needed: a joining node sends nothing else,
+    // and gateway frames are sent one at a time
+    f->pending = 0;
+    f->end_us = f->start_us + frame_airtime_us(f);
+    count_airtime(f);
+}
+
+// Radio task: run the queued requests until a frame goes out
+static void gateway_next_cmd(void) {
+    while (!gw_sending && tx_count > 0) {
+        sim_cmd_t cmd = tx_queue[tx_head];
+        tx_head = (tx_head + 1) % SIM_TX_QUEUE_LEN;
+        tx_count--;
+        const lora_profile_t *tx = &SIM_TX_RADIO->profile;
+        if (cmd.op == SIM_CMD_PROFILE) {
+            for (int i = 0; i < radio_count; i++) {
+                radios[i].profile = cmd.profile;
+                radios[i].profile_us = now_us;
+                radios[i].listening = i == 0;
+            }
+        } else if (cmd.op == SIM_CMD_RECEIVER) {
+            radios[cmd.rx].profile = cmd.profile;
+            radios[cmd.rx].profile_us = now_us;
+            radios[cmd.rx].listening = 1;
+        } else if (cmd.op == SIM_CMD_SLEEP) {
+            for (int i = 0; i < radio_count; i++) {
+                if (!cmd.sleep && radios[i].asleep) radios[i].profile_us = now_us + SIM_WAKE_US;
+                radios[i].asleep = cmd.sleep;
+            }
+        } else {
+            SIM_TX_RADIO->asleep = 0; // A frame to send wakes the transmitting radio
+            if (add_frame(SIM_GATEWAY, now_us, tx->frequency, tx->sf, tx->bw, tx->implicit_len != 0, 1, cmd.payload, cmd.len) >= 0) {
+                gw_sending = 1;
+            }
+        }
+    }
+}
+
+// Handle the next event by until_us: the end of a frame, or a channel
+// check before a frame
+static int deliver_next(int64_t until_us) {
+    int next = -1;
+    for (int i = 0; i < frame_count; i++) {
+        if (frames[i].delivered || frames[i].end_us > until_us) continue;
+        if (next < 0 || frames[i].end_us < frames[next].end_us) next = i;
+    }
+    if (next < 0) return 0;
+
+    if (frames[next].pending) {
+        if (frames[next].start_us > now_us) now_us = frames[next].start_us;
+        channel_check(&frames[next]);
+        return 1;
+    }
+    frames[next].delivered = 1;
+    sim_frame_t f = frames[next];
+    stats.busy_us += busy_us(&f);
+    if (f.end_us > now_us) now_us = f.end_us;
+    if (f.sender == SIM_GATEWAY) {
+        deliver_downlink(&f);
+        gw_sending = 0;
+        gw_tx_end_us = f.end_us;
+        gateway_next_cmd();
+    } else {
+        deliver_uplink(&f);
+    }
+    return 1;
+}
+
+static void advance(int64_t until_us) {
+    while (deliver_next(until_us)) {
+    }
+    if (now_us < until_us) now_us = until_us;
+}
+
+void sim_init(const sim_config_t *cfg) {
+    config = *cfg;
+    if (config.nodes > SIM_MAX_NODES) config.nodes = SIM_MAX_NODES;
+    rng = cfg->seed ? cfg->seed : 1;
+    memset(&stats, 0, sizeof(stats));
+    frame_count = 0;
+    now_us = 0;
+    rx_head = rx_count = rx_dropped = 0;
+    rx_errors = 0;
+    radio_count = config.receivers < 1 ? 1 : config.receivers > SIM_MAX_RADIOS ? SIM_MAX_RADIOS : config.receivers;
+    for (int i = 0; i < radio_count; i++) {
+        radios[i].profile = gateway_profile;
+        radios[i].profile_us = 0;
+        radios[i].listening = i == 0;
+        radios[i].asleep = 0;
+    }
+    gw_tx_end_us = 0;
+    gw_sending = 0;
+    tx_head = tx_count = 0;
+
+    for (int i = 0; i < config.nodes; i++) {
+        memset(&nodes[i], 0, sizeof(nodes[i]));
+        nodes[i].id = i;
+        nodes[i].snr_db = config.snr_min_db + (float)rand_unit() * (config.snr_max_db - config.snr_min_db);
+        nodes[i].t_home = nodes[i].t = 2000 + i * 37 % 1000; // Off the random stream, which sets the links
+        nodes[i].h_home = nodes[i].h = 4500 + i * 73 % 1000;
+    }
+}
+
+// Let the channel run while the gateway is idle, e.g. between cycles
+void sim_run_until(int64_t t_us) {
+    advance(t_us);
+}
+
+void sim_get_stats(sim_stats_t *out) {
+    stats.joined = 0;
+    for (int i = 0; i < config.nodes; i++) stats.joined += nodes[i].joined;
+    *out = stats;
+}
+
+void sim_log(int level, const char *tag, const char *fmt, ...) {
+    if (level > sim_log_level) return;
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%10.3f %s: ", now_us / 1e6, tag);
+    vprintf(fmt, ap);
+    putchar('\n');
+    va_end(ap);
+}
+
+/*
+ * hal.h
+ */
+
+// Queue a request for the radio task, waiting up to timeout_ms for room
+static int gateway_queue(const sim_cmd_t *cmd, int timeout_ms) {
+    advance(now_us);
+    int64_t deadline_us = now_us + (int64_t)timeout_ms * 1000;
+    while (tx_count == SIM_TX_QUEUE_LEN && deliver_next(deadline_us)) {
+    }
+    if (tx_count == SIM_TX_QUEUE_LEN) {
+        if (now_us < deadline_us) now_us = deadline_us;
+        return 0;
+    }
+    tx_queue[(tx_head + tx_count++) % SIM_TX_QUEUE_LEN] = *cmd;
+    gateway_next_cmd();
+    return 1;
+}
+
+int hal_radio_send(const uint8_t *buf, int len, int timeout_ms) {
+    if (len <= 0 || len > PROTO_MAX_LEN) return 0;
+    sim_cmd_t cmd = { .op = SIM_CMD_SEND, .len = len };
+    memcpy(cmd.payload, buf, len);
+    return gateway_queue(&cmd, timeout_ms);
+}
+
+int hal_radio_set_profile(const lora_profile_t *profile, int timeout_ms) {
+    sim_cmd_t cmd = { .op = SIM_CMD_PROFILE, .profile = *profile };
+    return gateway_queue(&cmd, timeout_ms);
+}
+
+int hal_radio_receivers(void) {
+    return radio_count;
+}
+
+int hal_radio_set_receiver(int rx, const lora_profile_t *profile, int timeout_ms) {
+    if (rx < 0 || rx >= radio_count) return 0;
+    sim_cmd_t cmd = { .op = SIM_CMD_RECEIVER, .rx = rx, .profile = *profile };
+    return gateway_queue(&cmd, timeout_ms);
+}
+
+int64_t hal_radio_flush(int timeout_ms) {
+    int64_t deadline_us = now_us + (int64_t)timeout_ms * 1000;
+    while ((gw_sending || tx_count > 0) && deliver_next(deadline_us)) {
+    }
+    if (gw_sending || tx_count > 0) {
+        if (now_us < deadline_us) now_us = deadline_us;
+        return 0;
+    }
+    return gw_tx_end_us;
+}
+
+int hal_radio_receive(lora_packet_t *pkt, int timeout_ms) {
+    int64_t deadline_us = now_us + (int64_t)timeout_ms * 1000;
+    while (rx_count == 0 && deliver_next(deadline_us)) {
+    }
+    if (rx_count == 0) {
+        if (now_us < deadline_us) now_us = deadline_us;
+        return 0;
+    }
+    *pkt = rx_queue[rx_head];
+    rx_head = (rx_head + 1) % SIM_RX_QUEUE_LEN;
+    rx_count--;
+    return 1;
+}
+
+uint32_t hal_radio_rx_errors(void) {
+    return rx_errors;
+}
+
+void hal_radio_dump_stats(void) {
+    printf("Uplinks %" PRIu32 ", collisions %" PRIu32 ", lost %" PRIu32 ", RX queue dropped %d\n",
+           stats.uplinks, stats.collisions, stats.lost, rx_dropped);
+    printf("Airtime %" PRId64 " ms, gateway %" PRId64 " ms\n", stats.airtime_us / 1000, stats.gateway_airtime_us / 1000);
+}
+
+void hal_radio_clear_stats(void) {
+    rx_dropped = 0;
+    rx_errors = 0;
+}
+
+int hal_radio_sleep(int timeout_ms) {
+    sim_cmd_t cmd = { .op = SIM_CMD_SLEEP, .sleep = 1 };
+    return gateway_queue(&cmd, timeout_ms);
+}
+
+// The radios listen again SIM_WAKE_US after the request has been run
+int64_t hal_radio_wake(int timeout_ms) {
+    sim_cmd_t cmd = { .op = SIM_CMD_SLEEP, .sleep = 0 };
+    if (!gateway_queue(&cmd, timeout_ms)) return 0;
+    hal_radio_flush(timeout_ms);
+    if (gw_sending || tx_count > 0) return 0;
+    advance(now_us + SIM_WAKE_US);
+    return now_us;
+}
+
+void hal_idle_until(int64_t t_us) {
+    advance(t_us);
+}
+
+int64_t hal_time_us(void) {
+    return now_us;
+}
+
+/*
+ * Telemetry function the gateway logic links against
+ */
+
+int telemetry_push(const telemetry_record_t *rec) {
+    stats.readings++;
+    return 1;
+}
+
+static int alerts_held;
+
+// Only the gateway cycle pushes, so an alert not held wakes the backhaul
+// inside a cycle
+int telemetry_push_alert(const telemetry_record_t *rec) {
+    stats.alerts++;
+    if (!alerts_held) stats.alert_wakes++;
+    return telemetry_push(rec);
+}
+
+void telemetry_hold_alerts(int hold) {
+    alerts_held = hold;
+}
@@ -0,0 +1,67 @@
+/* Simulated LoRa channel and nodes
+ *
+ * Implements hal.h on the host. Time is virtual: it only advances while
+ * the gateway waits in hal_radio_receive(), hal_radio_flush(),
+ * hal_idle_until() or sim_run_until(), so the gateway logic itself takes no
+ * time.
+ *
+ * The channel model:
+ * - airtime from the same formula as the driver (lora_airtime_us())
+ * - the gateway radio runs its requests in order and listens before talk,
+ *   as the radio task does
+ * - the gateway has one radio, or two: the first receives, the second
+ *   transmits and receives only after hal_radio_set_receiver()
+ * - a frame is lost when another frame with the same frequency, SF and
+ *   bandwidth overlaps it (no capture effect; a gateway radio listening to
+ *   the first of them reports a CRC error), when the gateway transmits
+ *   during it, when no radio listens on its frequency and setting since it
+ *   started, when that radio is asleep or not back in receive yet after
+ *   hal_radio_wake() (SIM_WAKE_US), when the link SNR is below the
+ *   demodulation floor of the SF, and at random with the configured
+ *   probability
+ *
+ * Nodes follow the protocol in protocol.h: they join, when the Open invites
+ * their id group, after a random delay of the Open backoff, once channel
+ * activity detection finds the channel free (a frame is detected one
+ * symbol after it started), send in their slot and on its channel after
+ * each beacon, answer requests with an ACK followed by their data and
+ * apply the rate changes of the Ok frame. Their readings drift slowly
+ * around a home value and are sent as deltas whenever the protocol
+ * allows; with exception reporting in the beacon a node leaves its slot
+ * empty unless protocol.h says it is due.
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+
+typedef struct {
+    int nodes;          // Simulated nodes, ids 0 to nodes - 1
+    double loss;        // Random loss probability per frame and receiver
+    float snr_min_db;   // Node link SNR at 125 kHz, uniform in this range
+    float snr_max_db;
+    uint32_t seed;
+    int receivers;      // Gateway radios, 1 or 2
+} sim_config_t;
+
+typedef struct {
+    int64_t airtime_us;         // All frames, gateway and nodes
+    int64_t gateway_airtime_us;
+    int64_t busy_us;            // Time some frame was on air, summed over the frequencies
+    uint32_t uplinks;           // Node frames on air
+    uint32_t collisions;        // Node frames lost to an overlapping frame
+    uint32_t lost;              // Node frames lost otherwise
+    uint32_t readings;          // Readings pushed by the gateway
+    uint32_t alerts;            // Of which pushed as alerts
+    uint32_t alert_wakes;       // Alerts that woke the backhaul during a cycle
+    int joined;                 // Nodes holding a slot
+} sim_stats_t;
+
+extern int sim_log_level;
+
+void sim_init(const sim_config_t *cfg);
+void sim_run_until(int64_t t_us);
+void sim_get_stats(sim_stats_t *stats);
+
+#endif